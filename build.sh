@@ -9,12 +9,16 @@ CFLAGS="-std=c11 -Wextra"
 
 echo "[1/2] compiling HASM..."
 gcc $CFLAGS \
-    hasm/main.c hasm/lexer.c hasm/parser.c \
+    hasm/main.c hasm/hasm.c hasm/lexer.c hasm/parser.c hasm/layout.c \
+    hvm/program.c hvm/edge_profile.c \
     -o "$BUILD_DIR/hasm"
 
 echo "[2/2] compiling HVM..."
 gcc $CFLAGS \
-    hvm/main.c hvm/honey.c \
+    hvm/main.c hvm/honey.c hvm/program.c hvm/heap.c hvm/natives.c hvm/aio.c hvm/edge_profile.c \
+    hvm/sched.c hvm/server.c hvm/perf.c hvm/profiler.c hvm/trace.c hvm/parfor.c \
+    hasm/hasm.c hasm/lexer.c hasm/parser.c \
+    -pthread -lm \
     -o "$BUILD_DIR/hvm"
 
 echo "log -> build completed"
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include "hasm.h"
+#include "parser.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char *hasm_read_source(const char *filepath, size_t *out_size) {
+  FILE *file = fopen(filepath, "r");
+  if (!file) {
+    fprintf(stderr, "error -> invalid input filepath.\n");
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  *out_size = ftell(file);
+  rewind(file);
+
+  char *buffer = malloc(sizeof(char) * (*out_size + 1));
+  if (!buffer) {
+    fprintf(stderr, "error -> cannot alloc memory to file buffer.\n");
+    fclose(file);
+    return NULL;
+  }
+
+  *out_size = fread(buffer, sizeof(char), *out_size, file);
+  buffer[*out_size] = '\0';
+  fclose(file);
+
+  return buffer;
+}
+
+bool hasm_assemble(const char *source, size_t size, const char *source_path,
+                   bool emit_debug, honey_program_t *out) {
+  memset(out, 0, sizeof(honey_program_t));
+
+  lexer_t *lexer = lexer_new(sv_create(source, size));
+  size_t token_count;
+  token_t *tokens = lexer_lex(lexer, &token_count);
+  bool lexed = !lexer->failed;
+  lexer_free(lexer);
+
+  if (!lexed) {
+    free(tokens);
+    return false;
+  }
+
+  parser_t *parser = parser_new(tokens, token_count);
+  out->code = parser_parse(parser, &out->size);
+  if (out->code) {
+    out->imports = parser_imports(parser, &out->import_count);
+    out->strings = parser_strings(parser, &out->string_count);
+    if (emit_debug)
+      out->debug = parser_debug(parser, source_path, out->size);
+  }
+
+  parser_free(parser);
+  free(tokens);
+  return out->code != NULL;
+}
+
+char *hasm_cache_dir(void) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *suffix = "/honey";
+  if (!base || base[0] == '\0') {
+    base = getenv("HOME");
+    suffix = "/.cache/honey";
+  }
+  if (!base || base[0] == '\0')
+    return NULL;
+
+  char *dir = malloc(strlen(base) + strlen(suffix) + 1);
+  strcpy(dir, base);
+  strcat(dir, suffix);
+  return dir;
+}
+
+static uint64_t hasm_hash(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+
+  return hash;
+}
+
+// mkdir -p, the cache usually lives under a directory nobody created yet
+static bool hasm_make_dirs(const char *dir) {
+  char *path = strdup(dir);
+  for (char *cursor = path + 1;; cursor++) {
+    if (*cursor != '/' && *cursor != '\0')
+      continue;
+
+    char saved = *cursor;
+    *cursor = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      free(path);
+      return false;
+    }
+
+    *cursor = saved;
+    if (saved == '\0')
+      break;
+  }
+
+  free(path);
+  return true;
+}
+
+bool hasm_load(const char *filepath, const char *cache_dir, honey_program_t *out) {
+  size_t size;
+  char *source = hasm_read_source(filepath, &size);
+  if (!source)
+    return false;
+
+  char *cache_path = NULL;
+  if (cache_dir) {
+    // the path is part of the key because the debug section records it
+    uint32_t version = HASM_CACHE_VERSION;
+    uint64_t hash = hasm_hash(0xcbf29ce484222325ull, &version, sizeof(version));
+    hash = hasm_hash(hash, filepath, strlen(filepath) + 1);
+    hash = hasm_hash(hash, source, size);
+
+    if (asprintf(&cache_path, "%s/%016lx.hbc", cache_dir, hash) < 0)
+      cache_path = NULL;
+  }
+
+  // entries always carry a debug section, anything else was not written by
+  // us and is simply assembled again
+  if (cache_path && access(cache_path, R_OK) == 0 && honey_program_load(cache_path, out)) {
+    if (out->debug && out->debug->line_count == out->size) {
+      free(cache_path);
+      free(source);
+      return true;
+    }
+
+    honey_program_free(out);
+  }
+
+  bool assembled = hasm_assemble(source, size, filepath, true, out);
+  free(source);
+  if (!assembled) {
+    free(cache_path);
+    return false;
+  }
+
+  if (cache_path && hasm_make_dirs(cache_dir)) {
+    // write next to the entry and rename, so concurrent runs never read a
+    // half written program
+    char *temp_path;
+    if (asprintf(&temp_path, "%s.%d", cache_path, (int)getpid()) >= 0) {
+      if (honey_program_write(temp_path, out))
+        rename(temp_path, cache_path);
+      else
+        unlink(temp_path);
+      free(temp_path);
+    }
+  }
+
+  free(cache_path);
+  return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../hvm/program.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bump whenever lexer, parser or codegen output changes, so cached
+// programs from older builds are never picked up. 2: number literals are
+// parsed as full 64-bit integers and floats instead of through atoi.
+#define HASM_CACHE_VERSION 2
+
+// Reads a whole source file, NUL terminated. Returns NULL on failure.
+char *hasm_read_source(const char *filepath, size_t *out_size);
+
+// Assembles `size` bytes of source straight into `out`. `source_path` names
+// the source in the debug section emitted with `emit_debug`. Returns false
+// on a syntax error, which is reported on stderr; `out` is left empty and
+// the caller decides whether to exit.
+bool hasm_assemble(const char *source, size_t size, const char *source_path,
+                   bool emit_debug, honey_program_t *out);
+
+// Default cache directory ($XDG_CACHE_HOME/honey or ~/.cache/honey), NULL
+// when neither is set. The caller frees it.
+char *hasm_cache_dir(void);
+
+// Assembles `filepath` with debug info, reusing `<cache_dir>/<hash>.hbc`
+// when a previous run already assembled the same source. A NULL
+// `cache_dir` always assembles. Returns false when the source cannot be
+// read or does not assemble.
+bool hasm_load(const char *filepath, const char *cache_dir, honey_program_t *out);
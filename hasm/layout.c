@@ -0,0 +1,369 @@
+#include "layout.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_BLOCK SIZE_MAX
+
+typedef struct {
+  size_t start, end;
+  uint64_t count, heat;
+
+  // successors: the jump target and the source order fallthrough
+  size_t taken, next;
+  uint64_t taken_weight, next_weight;
+
+  size_t chain, chain_next;
+  size_t new_start;
+} block_t;
+
+typedef struct {
+  size_t chain;
+  size_t head, tail;
+  uint64_t heat;
+} chain_t;
+
+typedef struct {
+  size_t from, to;
+  uint64_t weight;
+  bool fallthrough;
+} edge_t;
+
+static bool layout_has_target(inst_op_t op) {
+  return op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_SPAWN;
+}
+
+static bool layout_ends_block(inst_op_t op) {
+  return op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_HALT;
+}
+
+static bool layout_is_conditional(inst_op_t op) {
+  return op == OP_JZ || op == OP_JNZ;
+}
+
+// follows blocks made of a single in-range `jmp`, cycles end the walk
+static size_t layout_thread(const block_t *blocks, size_t block_count,
+                            const size_t *block_of, const inst_t *code,
+                            size_t size, size_t block) {
+  for (size_t hops = 0; hops < block_count; hops++) {
+    const inst_t *first = &code[blocks[block].start];
+    if (blocks[block].end - blocks[block].start != 1 || first->op != OP_JMP ||
+        first->operand.as_u64 >= size)
+      break;
+
+    block = block_of[first->operand.as_u64];
+  }
+
+  return block;
+}
+
+bool layout_profile_matches(const honey_program_t *program,
+                            const edge_profile_t *profile) {
+  return profile->size == program->size &&
+         profile->checksum == honey_program_checksum(program->code, program->size);
+}
+
+// heavier edges first, fallthroughs before jumps, then source order
+static int layout_edge_compare(const void *a, const void *b) {
+  const edge_t *x = a, *y = b;
+  if (x->weight != y->weight)
+    return x->weight > y->weight ? -1 : 1;
+  if (x->fallthrough != y->fallthrough)
+    return x->fallthrough ? -1 : 1;
+  if (x->from != y->from)
+    return x->from < y->from ? -1 : 1;
+  return 0;
+}
+
+// the entry chain stays first, hot chains by heat, cold chains in source order
+static int layout_chain_compare(const void *a, const void *b) {
+  const chain_t *x = a, *y = b;
+  if ((x->head == 0) != (y->head == 0))
+    return x->head == 0 ? -1 : 1;
+  if ((x->heat == 0) != (y->heat == 0))
+    return x->heat == 0 ? 1 : -1;
+  if (x->heat != y->heat)
+    return x->heat > y->heat ? -1 : 1;
+  return x->head < y->head ? -1 : x->head > y->head;
+}
+
+static int layout_label_compare(const void *a, const void *b) {
+  const honey_label_t *x = a, *y = b;
+  return x->ip < y->ip ? -1 : x->ip > y->ip;
+}
+
+void layout_apply(honey_program_t *program, const edge_profile_t *profile) {
+  const inst_t *code = program->code;
+  size_t size = program->size;
+  if (size == 0)
+    return;
+
+  // parfor bodies are address ranges, moving blocks would tear them apart
+  for (size_t i = 0; i < size; i++) {
+    if (code[i].op == OP_PARFOR) {
+      fprintf(stderr, "warning -> program uses parfor, keeping source order.\n");
+      return;
+    }
+  }
+
+  // 1. split into basic blocks at jump targets, labels and after branches
+  bool *leader = calloc(size + 1, sizeof(bool));
+  leader[0] = true;
+  for (size_t i = 0; i < size; i++) {
+    if (layout_has_target(code[i].op) && code[i].operand.as_u64 < size)
+      leader[code[i].operand.as_u64] = true;
+    if (layout_ends_block(code[i].op))
+      leader[i + 1] = true;
+  }
+
+  if (program->debug) {
+    for (size_t i = 0; i < program->debug->label_count; i++) {
+      if (program->debug->labels[i].ip < size)
+        leader[program->debug->labels[i].ip] = true;
+    }
+  }
+
+  size_t *block_of = malloc(sizeof(size_t) * size);
+  block_t *blocks = calloc(size, sizeof(block_t));
+  size_t block_count = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (leader[i]) {
+      blocks[block_count].start = i;
+      blocks[block_count].chain = block_count;
+      blocks[block_count].chain_next = NO_BLOCK;
+      block_count++;
+    }
+
+    blocks[block_count - 1].end = i + 1;
+    block_of[i] = block_count - 1;
+  }
+
+  // 2. block counts from the branch counts: entries through jumps and
+  // spawns plus whatever falls through from the previous block
+  uint64_t *incoming = calloc(block_count, sizeof(uint64_t));
+  incoming[0] = 1;
+  for (size_t i = 0; i < size; i++) {
+    if (layout_has_target(code[i].op) && code[i].operand.as_u64 < size)
+      incoming[block_of[code[i].operand.as_u64]] += profile->taken[i];
+  }
+
+  for (size_t b = 0; b < block_count; b++) {
+    inst_t last = code[blocks[b].end - 1];
+    blocks[b].count = incoming[b];
+    if (b + 1 >= block_count || last.op == OP_JMP || last.op == OP_HALT)
+      continue;
+
+    incoming[b + 1] += layout_is_conditional(last.op)
+                           ? profile->fallthrough[blocks[b].end - 1]
+                           : blocks[b].count;
+  }
+
+  // successors skip blocks that only jump elsewhere, so a loop exit test
+  // can branch straight back to the loop head
+  for (size_t b = 0; b < block_count; b++) {
+    block_t *block = &blocks[b];
+    size_t last_ip = block->end - 1;
+    inst_t last = code[last_ip];
+
+    block->taken = NO_BLOCK;
+    if (last.op != OP_SPAWN && layout_has_target(last.op) && last.operand.as_u64 < size) {
+      block->taken = layout_thread(blocks, block_count, block_of, code, size,
+                                   block_of[last.operand.as_u64]);
+      block->taken_weight = profile->taken[last_ip];
+    }
+
+    block->next = NO_BLOCK;
+    if (last.op != OP_JMP && last.op != OP_HALT && b + 1 < block_count) {
+      block->next = layout_thread(blocks, block_count, block_of, code, size, b + 1);
+      block->next_weight = layout_is_conditional(last.op) ? profile->fallthrough[last_ip]
+                                                          : block->count;
+    }
+  }
+
+  // heat only counts the entries that remain after threading
+  for (size_t b = 0; b < block_count; b++)
+    blocks[b].heat = b == 0;
+  for (size_t i = 0; i < size; i++) {
+    if (code[i].op == OP_SPAWN && code[i].operand.as_u64 < size)
+      blocks[block_of[code[i].operand.as_u64]].heat += profile->taken[i];
+  }
+  for (size_t b = 0; b < block_count; b++) {
+    if (blocks[b].taken != NO_BLOCK)
+      blocks[blocks[b].taken].heat += blocks[b].taken_weight;
+    if (blocks[b].next != NO_BLOCK)
+      blocks[blocks[b].next].heat += blocks[b].next_weight;
+  }
+
+  // a jump-only block that everything now bypasses keeps no edge weight
+  for (size_t b = 0; b < block_count; b++) {
+    if (blocks[b].heat == 0)
+      blocks[b].taken_weight = blocks[b].next_weight = 0;
+  }
+
+  // 3. greedily chain blocks along the heaviest edges so that they become
+  // fallthroughs; cold fallthroughs keep source order
+  edge_t *edges = malloc(sizeof(edge_t) * block_count * 2);
+  size_t edge_count = 0;
+  for (size_t b = 0; b < block_count; b++) {
+    if (blocks[b].taken != NO_BLOCK && blocks[b].taken_weight > 0)
+      edges[edge_count++] = (edge_t){b, blocks[b].taken, blocks[b].taken_weight, false};
+    if (blocks[b].next != NO_BLOCK)
+      edges[edge_count++] = (edge_t){b, blocks[b].next, blocks[b].next_weight, true};
+  }
+  qsort(edges, edge_count, sizeof(edge_t), layout_edge_compare);
+
+  size_t *chain_head = malloc(sizeof(size_t) * block_count);
+  size_t *chain_tail = malloc(sizeof(size_t) * block_count);
+  for (size_t b = 0; b < block_count; b++)
+    chain_head[b] = chain_tail[b] = b;
+
+  for (size_t i = 0; i < edge_count; i++) {
+    size_t from = edges[i].from, to = edges[i].to;
+    size_t from_chain = blocks[from].chain, to_chain = blocks[to].chain;
+
+    // the entry block has to stay at ip 0, and cold code is not appended
+    // to a hot chain just because it follows it in the source
+    if (edges[i].weight == 0 && blocks[from].heat > 0)
+      continue;
+    if (to == 0 || from_chain == to_chain || chain_tail[from_chain] != from ||
+        chain_head[to_chain] != to)
+      continue;
+
+    blocks[from].chain_next = to;
+    chain_tail[from_chain] = chain_tail[to_chain];
+    for (size_t b = to; b != NO_BLOCK; b = blocks[b].chain_next)
+      blocks[b].chain = from_chain;
+  }
+
+  chain_t *chains = malloc(sizeof(chain_t) * block_count);
+  size_t chain_count = 0;
+  for (size_t b = 0; b < block_count; b++) {
+    if (blocks[b].chain != b)
+      continue;
+
+    chain_t chain = {.chain = b, .head = chain_head[b], .tail = chain_tail[b]};
+    for (size_t c = chain.head; c != NO_BLOCK; c = blocks[c].chain_next)
+      chain.heat += blocks[c].heat;
+    chains[chain_count++] = chain;
+  }
+  qsort(chains, chain_count, sizeof(chain_t), layout_chain_compare);
+
+  size_t *order = malloc(sizeof(size_t) * block_count);
+  size_t order_count = 0;
+  for (size_t c = 0; c < chain_count; c++) {
+    for (size_t b = chains[c].head; b != NO_BLOCK; b = blocks[b].chain_next)
+      order[order_count++] = b;
+  }
+
+  // 4. emit in the new order, fixing up terminators against the block that
+  // now follows; targets are recorded as blocks and patched afterwards
+  size_t cap = size * 2 + 1;
+  inst_t *out = malloc(sizeof(inst_t) * cap);
+  size_t *out_target = malloc(sizeof(size_t) * cap);
+  uint32_t *out_lines = malloc(sizeof(uint32_t) * cap);
+  size_t out_count = 0;
+
+  const uint32_t *lines = program->debug ? program->debug->lines : NULL;
+  const size_t end_block = block_count;
+
+#define EMIT(inst, target, line)                                               \
+  do {                                                                         \
+    out[out_count] = (inst);                                                   \
+    out_target[out_count] = (target);                                          \
+    out_lines[out_count] = (line);                                             \
+    out_count++;                                                               \
+  } while (0)
+
+  for (size_t o = 0; o < order_count; o++) {
+    block_t *block = &blocks[order[o]];
+    size_t follower = o + 1 < order_count ? order[o + 1] : NO_BLOCK;
+    block->new_start = out_count;
+
+    for (size_t i = block->start; i + 1 < block->end; i++) {
+      size_t target = NO_BLOCK;
+      if (layout_has_target(code[i].op))
+        target = code[i].operand.as_u64 < size ? block_of[code[i].operand.as_u64] : end_block;
+      EMIT(code[i], target, lines ? lines[i] : 0);
+    }
+
+    size_t last_ip = block->end - 1;
+    inst_t last = code[last_ip];
+    uint32_t line = lines ? lines[last_ip] : 0;
+    size_t taken = block->taken != NO_BLOCK ? block->taken : end_block;
+    size_t next = block->next != NO_BLOCK ? block->next : end_block;
+    if (last.op == OP_SPAWN)
+      taken = last.operand.as_u64 < size ? block_of[last.operand.as_u64] : end_block;
+    inst_t jmp = {.op = OP_JMP};
+
+    switch (last.op) {
+    case OP_JMP:
+      if (taken != follower)
+        EMIT(last, taken, line);
+      break;
+    case OP_JZ:
+    case OP_JNZ:
+      if (next == follower) {
+        EMIT(last, taken, line);
+      } else if (taken == follower) {
+        last.op = last.op == OP_JZ ? OP_JNZ : OP_JZ;
+        EMIT(last, next, line);
+      } else {
+        EMIT(last, taken, line);
+        EMIT(jmp, next, line);
+      }
+      break;
+    case OP_HALT:
+      EMIT(last, NO_BLOCK, line);
+      break;
+    default:
+      EMIT(last, layout_has_target(last.op) ? taken : NO_BLOCK, line);
+      if (next != follower)
+        EMIT(jmp, next, line);
+      break;
+    }
+  }
+
+#undef EMIT
+
+  for (size_t i = 0; i < out_count; i++) {
+    if (out_target[i] == NO_BLOCK)
+      continue;
+
+    // targets past the code keep pointing past it and still trap
+    out[i].operand.as_u64 =
+        out_target[i] == end_block ? out_count : blocks[out_target[i]].new_start;
+  }
+
+  if (program->debug) {
+    honey_debug_t *debug = program->debug;
+    for (size_t i = 0; i < debug->label_count; i++) {
+      size_t ip = debug->labels[i].ip;
+      debug->labels[i].ip = ip < size ? blocks[block_of[ip]].new_start : out_count;
+    }
+    qsort(debug->labels, debug->label_count, sizeof(honey_label_t),
+          layout_label_compare);
+
+    free(debug->lines);
+    debug->lines = out_lines;
+    debug->line_count = out_count;
+    out_lines = NULL;
+  }
+
+  free(program->code);
+  program->code = out;
+  program->size = out_count;
+
+  free(out_lines);
+  free(out_target);
+  free(order);
+  free(chains);
+  free(chain_head);
+  free(chain_tail);
+  free(edges);
+  free(incoming);
+  free(blocks);
+  free(block_of);
+  free(leader);
+}
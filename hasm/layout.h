@@ -0,0 +1,15 @@
+#pragma once
+
+#include "../hvm/edge_profile.h"
+#include "../hvm/program.h"
+#include <stdbool.h>
+
+// Reorders the basic blocks of `program` from an edge profile of the same
+// code: hot successors are placed as fallthroughs (inverting conditional
+// branches where needed) and never executed blocks move to the end. Jump
+// targets, spawn entries and debug lines/labels are remapped.
+void layout_apply(honey_program_t *program, const edge_profile_t *profile);
+
+// true when `profile` was recorded against exactly this instruction stream
+bool layout_profile_matches(const honey_program_t *program,
+                            const edge_profile_t *profile);
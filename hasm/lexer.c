@@ -8,24 +8,36 @@ static bool lexer_ident_predicate(char c) {
 }
 
 static bool lexer_number_predicate(char c) { return (bool)isdigit(c); }
+static bool lexer_hex_predicate(char c) { return (bool)isxdigit(c); }
 static bool lexer_comment_predicate(char c) { return c != '\n'; }
 
 lexer_t *lexer_new(strview_t buffer) {
   lexer_t *lexer = malloc(sizeof(lexer_t));
   lexer->buffer = buffer;
   lexer->cursor = 0;
+  lexer->line = 1;
+  lexer->failed = false;
 
   return lexer;
 }
 
 void lexer_free(lexer_t *lexer) { free(lexer); }
 
+static void lexer_advance(lexer_t *lexer, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (lexer->buffer.buffer[lexer->cursor + i] == '\n')
+      lexer->line++;
+  }
+
+  lexer->cursor += count;
+}
+
 token_t *lexer_lex(lexer_t *lexer, size_t *out_tokens_size) {
   size_t token_count = 0;
   size_t token_cap = 25;
   token_t *tokens = (token_t*) calloc(token_cap, sizeof(token_t));
 
-  while (lexer->cursor < lexer->buffer.length) {
+  while (1) {
     token_t current = lexer_tokenize(lexer);
     if (token_count >= token_cap) {
       token_cap *= 2;
@@ -33,6 +45,8 @@ token_t *lexer_lex(lexer_t *lexer, size_t *out_tokens_size) {
     }
 
     tokens[token_count++] = current;
+    if (current.kind == TOK_EOF)
+      break;
   }
 
   *out_tokens_size = token_count;
@@ -43,35 +57,89 @@ token_t lexer_tokenize(lexer_t *lexer) {
   strview_t source = sv_slice(lexer->buffer, lexer->cursor, SV_END);
 
   size_t spaces = sv_ltrim(&source);
-  lexer->cursor += spaces;
+  lexer_advance(lexer, spaces);
   
   while (sv_starts_with(source, SV("#"))) {
     strview_t comment = sv_take_while(source, lexer_comment_predicate);
     sv_ldrop(&source, comment.length);
+    lexer_advance(lexer, comment.length);
     spaces = sv_ltrim(&source);
-    lexer->cursor += comment.length + spaces;
+    lexer_advance(lexer, spaces);
   }
   
+  size_t line = lexer->line;
   if (source.length <= 0) {
-    return (token_t){.kind = TOK_EOF, .lexeme = SV("\0")};
+    return (token_t){.kind = TOK_EOF, .lexeme = SV("\0"), .line = line};
   }    
 
-  strview_t number = sv_take_while(source, lexer_number_predicate);
+  // [-]digits, [-]0x<hex>, or [-]digits.digits[e[+-]digits] for floats
+  size_t sign = sv_starts_with(source, SV("-")) ? 1 : 0;
+  strview_t unsigned_source = sv_slice(source, sign, SV_END);
+  strview_t number = sv_take_while(unsigned_source, lexer_number_predicate);
   if (number.length > 0) {
-    lexer->cursor += number.length;
-    return (token_t){.kind = TOK_NUMBER, .lexeme = number};
+    token_kind_t kind = TOK_NUMBER;
+    size_t length = number.length;
+
+    if ((sv_starts_with(unsigned_source, SV("0x")) ||
+         sv_starts_with(unsigned_source, SV("0X"))) && number.length == 1) {
+      strview_t digits = sv_take_while(sv_slice(unsigned_source, 2, SV_END),
+                                       lexer_hex_predicate);
+      length = 2 + digits.length;
+    } else {
+      strview_t rest = sv_slice(unsigned_source, length, SV_END);
+      if (sv_starts_with(rest, SV("."))) {
+        strview_t fraction = sv_take_while(sv_slice(rest, 1, SV_END), lexer_number_predicate);
+        kind = TOK_FLOAT;
+        length += 1 + fraction.length;
+        rest = sv_slice(unsigned_source, length, SV_END);
+      }
+
+      if (sv_starts_with(rest, SV("e")) || sv_starts_with(rest, SV("E"))) {
+        strview_t exponent = sv_slice(rest, 1, SV_END);
+        size_t exponent_sign =
+            sv_starts_with(exponent, SV("-")) || sv_starts_with(exponent, SV("+"));
+        exponent = sv_take_while(sv_slice(exponent, exponent_sign, SV_END),
+                                 lexer_number_predicate);
+        if (exponent.length > 0) {
+          kind = TOK_FLOAT;
+          length += 1 + exponent_sign + exponent.length;
+        }
+      }
+    }
+
+    lexer_advance(lexer, sign + length);
+    return (token_t){.kind = kind, .lexeme = sv_slice(source, 0, sign + length), .line = line};
   }
 
   strview_t identifier = sv_take_while(source, lexer_ident_predicate);
   if (identifier.length > 0) {
-    lexer->cursor += identifier.length;
-    return (token_t){.kind = TOK_IDENTIFIER, .lexeme = identifier};
+    lexer_advance(lexer, identifier.length);
+    return (token_t){.kind = TOK_IDENTIFIER, .lexeme = identifier, .line = line};
   }    
 
-  lexer->cursor++;
+  // "..." without escapes, the lexeme excludes the quotes
+  if (sv_starts_with(source, SV("\""))) {
+    size_t end = 1;
+    while (end < source.length && source.buffer[end] != '"' && source.buffer[end] != '\n')
+      end++;
+
+    if (end >= source.length || source.buffer[end] != '"') {
+      fprintf(stderr, "lexer (l: %zu, c: %zu) -> unterminated string.\n",
+              line, lexer->cursor);
+      lexer->failed = true;
+      return (token_t){.kind = TOK_EOF, .lexeme = SV("\0"), .line = line};
+    }
+
+    lexer_advance(lexer, end + 1);
+    return (token_t){.kind = TOK_STRING, .lexeme = sv_slice(source, 1, end), .line = line};
+  }
+
+  lexer_advance(lexer, 1);
   if (sv_starts_with(source, SV(":")))
-    return (token_t){.kind = TOK_COLON, .lexeme = SV(":")};
+    return (token_t){.kind = TOK_COLON, .lexeme = SV(":"), .line = line};
 
-  fprintf(stderr, "lexer (c: %zu) -> invalid token has found: %c", lexer->cursor, source.buffer[0]);
-  exit(EXIT_FAILURE);
+  fprintf(stderr, "lexer (l: %zu, c: %zu) -> invalid token has found: %c\n",
+          line, lexer->cursor, source.buffer[0]);
+  lexer->failed = true;
+  return (token_t){.kind = TOK_EOF, .lexeme = SV("\0"), .line = line};
 }
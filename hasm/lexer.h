@@ -1,14 +1,21 @@
 #include "../lib/sv.h"
+#include <stdbool.h>
 #include <stddef.h>
 
 typedef struct {
   strview_t buffer;
-  size_t cursor;
+  size_t cursor, line;
+
+  // set by the first invalid token, which was reported on stderr; lexing
+  // stops there as if the source ended
+  bool failed;
 } lexer_t;
 
 typedef enum {
   TOK_IDENTIFIER,
   TOK_NUMBER,
+  TOK_FLOAT,
+  TOK_STRING,
   TOK_COLON,
   TOK_EOF
 } token_kind_t;
@@ -16,6 +23,7 @@ typedef enum {
 typedef struct {
   token_kind_t kind;
   strview_t lexeme;
+  size_t line;
 } token_t;
 
 lexer_t *lexer_new(strview_t buffer);
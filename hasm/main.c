@@ -1,81 +1,78 @@
 #define SV_IMPL
 #include "../lib/sv.h"
 
-#include "parser.h"
+#include "hasm.h"
+#include "layout.h"
+#include "../hvm/program.h"
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-char *load_file_buffer(const char *filepath, size_t *out_size) {
-  FILE *file = fopen(filepath, "r");
-  if (!file) {
-    fprintf(stderr, "error -> invalid input filepath.\n");
-    exit(EXIT_FAILURE);
-  }
-
-  fseek(file, 0, SEEK_END);
-  *out_size = ftell(file);
-  rewind(file);
-
-  char *buffer = malloc(sizeof(char) * (*out_size + 1));
-  if (!buffer) {
-    fprintf(stderr, "error -> cannot alloc memory to file buffer.\n");
-    fclose(file);
-    exit(EXIT_FAILURE);
-  }
-
-  fread(buffer, sizeof(char), *out_size, file);
-  buffer[*out_size] = '\0';
-  fclose(file);
-
-  return buffer;
+void print_usage(void) {
+  printf("Usage: hasm [options] <input> <output>\n");
+  printf("Options:\n");
+  printf("  -g                      emit a debug section mapping instructions to source lines\n");
+  printf("  --profile-use <profile> reorder blocks from an `hvm --edge-profile` run\n");
 }
 
-void write_file_bytecode(const char *filepath, inst_t *instructions,
-                         size_t inst_count) {
-  FILE *output = fopen(filepath, "wb");
-  if (!output) {
-    fprintf(stderr, "error -> cannot open output file.\n");
-    exit(EXIT_FAILURE);
+int main(int argc, char **argv) {
+  char *input_path = NULL;
+  char *output_path = NULL;
+  char *profile_path = NULL;
+  bool emit_debug = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-g") == 0) {
+      emit_debug = true;
+    } else if (strcmp(argv[i], "--profile-use") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (argv[i][0] == '-' || output_path) {
+      printf("error -> invalid usage.\n");
+      print_usage();
+      return EXIT_FAILURE;
+    } else if (!input_path) {
+      input_path = argv[i];
+    } else {
+      output_path = argv[i];
+    }
   }
 
-  size_t write_count = fwrite(instructions, sizeof(inst_t), inst_count, output);
-  if (write_count != inst_count) {
-    fprintf(stderr, "error -> unexpected error during output file writing.\n");
-    fclose(output);
-    exit(EXIT_FAILURE);
+  if (!output_path) {
+    printf("error -> invalid usage.\n");
+    print_usage();
+    return EXIT_FAILURE;
   }
 
-  fclose(output);
-}
+  size_t source_code_len;
+  char *source_code = hasm_read_source(input_path, &source_code_len);
+  if (!source_code)
+    return EXIT_FAILURE;
 
-int main(int argc, char **argv) {
-  if (argc < 3) {
-    printf("error -> invalid usage.\n");
-    printf("Usage: hasm <input> <output>\n"); 
+  honey_program_t program;
+  if (!hasm_assemble(source_code, source_code_len, input_path, emit_debug, &program)) {
+    free(source_code);
     return EXIT_FAILURE;
   }
 
-  char *input_path = argv[1];
-  char *output_path = argv[2];
+  if (profile_path) {
+    edge_profile_t *profile = edge_profile_read(profile_path);
+    if (!profile)
+      return EXIT_FAILURE;
 
-  size_t source_code_len;
-  char *source_code = load_file_buffer(input_path, &source_code_len);
-
-  lexer_t *lexer = lexer_new(sv_create(source_code, source_code_len));
-  size_t token_count;
-  token_t *tokens = lexer_lex(lexer, &token_count);
+    if (layout_profile_matches(&program, profile))
+      layout_apply(&program, profile);
+    else
+      fprintf(stderr, "warning -> profile was recorded for different code, keeping source order.\n");
 
-  parser_t *parser = parser_new(tokens, token_count);
-  size_t inst_count;
-  inst_t *instructions = parser_parse(parser, &inst_count);
+    edge_profile_free(profile);
+  }
 
-  write_file_bytecode(output_path, instructions, inst_count);
+  if (!honey_program_write(output_path, &program))
+    return EXIT_FAILURE;
 
-  lexer_free(lexer);
-  parser_free(parser);
+  honey_program_free(&program);
   free(source_code);
-  free(tokens);
-  free(instructions);
 
   return 0;
 }
@@ -1,9 +1,12 @@
 #include "parser.h"
 #include "../hvm/honey.h"
 #include "../lib/sv.h"
+#include <errno.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct inst_info {
   const char* lexeme;
@@ -18,6 +21,26 @@ static struct inst_info NON_OPERAND_INSTS[] = {
     {"ltei", OP_LTEI},   {"eqi", OP_EQI},
     {"neqi", OP_NEQI},   {"noti", OP_NOTI},
     {"dump", OP_DUMP},   {"halt", OP_HALT},
+    {"yield", OP_YIELD}, {"join", OP_JOIN},
+    {"send", OP_SEND},   {"recv", OP_RECV},
+    {"alloc", OP_ALLOC}, {"getf", OP_GETF},
+    {"setf", OP_SETF},   {"len", OP_LEN},
+    {"bytes", OP_BYTES}, {"read", OP_READ},
+    {"write", OP_WRITE}, {"close", OP_CLOSE},
+    {"plusu", OP_PLUSU}, {"minusu", OP_MINUSU},
+    {"divu", OP_DIVU},   {"multu", OP_MULTU},
+    {"modu", OP_MODU},   {"gtu", OP_GTU},
+    {"gteu", OP_GTEU},   {"ltu", OP_LTU},
+    {"lteu", OP_LTEU},   {"plusf", OP_PLUSF},
+    {"minusf", OP_MINUSF}, {"divf", OP_DIVF},
+    {"multf", OP_MULTF}, {"modf", OP_MODF},
+    {"gtf", OP_GTF},     {"gtef", OP_GTEF},
+    {"ltf", OP_LTF},     {"ltef", OP_LTEF},
+    {"eqf", OP_EQF},     {"neqf", OP_NEQF},
+    {"itof", OP_ITOF},   {"ftoi", OP_FTOI},
+    {"utof", OP_UTOF},   {"ftou", OP_FTOU},
+    {"dumpi", OP_DUMPI}, {"dumpu", OP_DUMPU},
+    {"dumpf", OP_DUMPF},
 };
 
 static size_t NON_OPERAND_INSTS_COUNT = sizeof(NON_OPERAND_INSTS) / sizeof(struct inst_info);
@@ -35,29 +58,76 @@ parser_t *parser_new(token_t *tokens, size_t token_count) {
   parser->unresolved_addr_cap = 64;
   parser->unresolved_addrs = calloc(parser->unresolved_addr_cap, sizeof(label_t));
   
+  parser->import_count = 0;
+  parser->import_cap = 8;
+  parser->imports = calloc(parser->import_cap, sizeof(honey_import_t));
+
+  parser->string_count = 0;
+  parser->string_cap = 8;
+  parser->strings = calloc(parser->string_cap, sizeof(char *));
+
+  parser->inst_lines = NULL;
+  parser->current_line = 0;
+
   parser->cursor = 0;
+  parser->failed = false;
 
   return parser;
 }
 
-void parser_free(parser_t *parser) { free(parser); }
+void parser_free(parser_t *parser) {
+  free(parser->labels);
+  free(parser->unresolved_addrs);
+  for (size_t i = 0; i < parser->import_count; i++)
+    free(parser->imports[i].name);
+  free(parser->imports);
+  for (size_t i = 0; i < parser->string_count; i++)
+    free(parser->strings[i]);
+  free(parser->strings);
+  free(parser->inst_lines);
+  free(parser);
+}
 
 inst_t *parser_parse(parser_t *parser, size_t *out_size) {
   size_t inst_count = 0;
   size_t inst_cap = 32;
   inst_t *instructions = calloc(inst_cap, sizeof(inst_t));
+  parser->inst_lines = realloc(parser->inst_lines, inst_cap * sizeof(uint32_t));
+
+  while (!parser->failed && parser_peek(parser).kind != TOK_EOF) {
+    if (sv_equals(parser_peek(parser).lexeme, SV("import"))) {
+      parser_parse_import(parser);
+      continue;
+    }
+
+    // labels may also close the program, e.g. the end of a parfor body
+    if (parser_peek(parser).kind == TOK_IDENTIFIER &&
+        parser->tokens[parser->cursor + 1].kind == TOK_COLON) {
+      token_t label = parser_consume(parser);
+      parser_expect(parser, TOK_COLON);
+      parser_push_label(parser, label.lexeme, inst_count);
+      continue;
+    }
 
-  while (parser->cursor < parser->token_count) {
     inst_t current = parser_parse_inst(parser, inst_count);
     if (inst_count >= inst_cap) {
       inst_cap *= 2;
       instructions = realloc(instructions, inst_cap * sizeof(inst_t));
+      parser->inst_lines = realloc(parser->inst_lines, inst_cap * sizeof(uint32_t));
     }
 
+    parser->inst_lines[inst_count] = parser->current_line;
     instructions[inst_count++] = current;
   }
 
-  parser_resolve_addrs(parser, instructions, inst_count);
+  if (!parser->failed)
+    parser_resolve_addrs(parser, instructions, inst_count);
+
+  if (parser->failed) {
+    free(instructions);
+    *out_size = 0;
+    return NULL;
+  }
 
   *out_size = inst_count;
   return instructions;
@@ -65,50 +135,95 @@ inst_t *parser_parse(parser_t *parser, size_t *out_size) {
 
 inst_t parser_parse_inst(parser_t *parser, size_t inst_count) {
   token_t current = parser_consume(parser);
-
-  while (current.kind == TOK_IDENTIFIER && parser_peek(parser).kind == TOK_COLON) {
-    parser_expect(parser, TOK_COLON);
-    parser_push_label(parser, current.lexeme, inst_count);
-    current = parser_consume(parser);
-  }
+  parser->current_line = current.line;
  
   if (sv_equals(current.lexeme, SV("push"))) {
-    token_t operand = parser_expect(parser, TOK_NUMBER);
-    const char *parsed_lexeme = sv_to_cstr(operand.lexeme);
-    int64_t integer = atoi(parsed_lexeme);
-
-    return (inst_t){.op = OP_PUSH, .operand = {.as_i64 = integer}};
+    token_t operand = parser_consume(parser);
+    return (inst_t){.op = OP_PUSH, .operand = parser_parse_number(parser, operand)};
   }
 
-  if (sv_equals(current.lexeme, SV("dup"))) {
+  if (sv_equals(current.lexeme, SV("dup")) ||
+      sv_equals(current.lexeme, SV("chan")) ||
+      sv_equals(current.lexeme, SV("record"))) {
+    inst_op_t op = sv_equals(current.lexeme, SV("dup"))    ? OP_DUP
+                   : sv_equals(current.lexeme, SV("chan")) ? OP_CHAN
+                     : OP_RECORD;
     token_t operand = parser_expect(parser, TOK_NUMBER);
-    const char *parsed_lexeme = sv_to_cstr(operand.lexeme);
-    uint64_t integer = atoi(parsed_lexeme);
-
-    return (inst_t){.op = OP_DUP, .operand = {.as_u64 = integer}};
+    return (inst_t){.op = op, .operand = {.as_u64 = parser_parse_index(parser, operand)}};
   }
 
   if (sv_equals(current.lexeme, SV("jmp")) ||
       sv_equals(current.lexeme, SV("jz")) ||
-      sv_equals(current.lexeme, SV("jnz"))) {
+      sv_equals(current.lexeme, SV("jnz")) ||
+      sv_equals(current.lexeme, SV("spawn"))) {
     token_t operand = parser_peek(parser);
-    inst_op_t op = sv_equals(current.lexeme, SV("jmp"))  ? OP_JMP
-                   : sv_equals(current.lexeme, SV("jz")) ? OP_JZ
-                     : OP_JNZ;
+    inst_op_t op = sv_equals(current.lexeme, SV("jmp"))   ? OP_JMP
+                   : sv_equals(current.lexeme, SV("jz"))  ? OP_JZ
+                   : sv_equals(current.lexeme, SV("jnz")) ? OP_JNZ
+                     : OP_SPAWN;
     
     if (operand.kind == TOK_NUMBER) {
       parser_expect(parser, TOK_NUMBER);
-      const char *parsed_lexeme = sv_to_cstr(operand.lexeme);
-      uint64_t integer = atoi(parsed_lexeme);
-
-      return (inst_t){.op = op, .operand = {.as_i64 = integer}};
+      return (inst_t){.op = op, .operand = {.as_u64 = parser_parse_index(parser, operand)}};
     } else {
       operand = parser_expect(parser, TOK_IDENTIFIER);
-      parser_push_unresolved_addr(parser, operand.lexeme, inst_count);
+      parser_push_unresolved_addr(parser, operand.lexeme, inst_count, 0);
       return (inst_t) {.op = op};
     }
   }
 
+  if (sv_equals(current.lexeme, SV("callnative"))) {
+    token_t operand = parser_consume(parser);
+    if (operand.kind == TOK_NUMBER)
+      return (inst_t){.op = OP_CALLNATIVE, .operand = {.as_u64 = parser_parse_index(parser, operand)}};
+
+    for (size_t i = 0; i < parser->import_count; i++) {
+      if (sv_equals(operand.lexeme, SV(parser->imports[i].name)))
+        return (inst_t){.op = OP_CALLNATIVE, .operand = {.as_u64 = i}};
+    }
+
+    parser_error(parser, "parser (l: %zu) -> native '" SV_FMT "' is not imported.\n",
+                 operand.line, SV_ARG(operand.lexeme));
+    return (inst_t){.op = OP_CALLNATIVE};
+  }
+
+  // parfor <reduction> <body> <end>, the body being [body, end)
+  if (sv_equals(current.lexeme, SV("parfor"))) {
+    static const char *reductions[PARFOR_REDUCE_COUNT] = {
+        [PARFOR_SUMI] = "sumi", [PARFOR_MINI] = "mini", [PARFOR_MAXI] = "maxi",
+        [PARFOR_SUMU] = "sumu", [PARFOR_MINU] = "minu", [PARFOR_MAXU] = "maxu",
+        [PARFOR_SUMF] = "sumf", [PARFOR_MINF] = "minf", [PARFOR_MAXF] = "maxf",
+    };
+
+    token_t reduction = parser_expect(parser, TOK_IDENTIFIER);
+    uint64_t reduce = PARFOR_REDUCE_COUNT;
+    for (size_t i = 0; i < PARFOR_REDUCE_COUNT; i++) {
+      if (sv_equals(reduction.lexeme, SV(reductions[i])))
+        reduce = i;
+    }
+
+    if (reduce == PARFOR_REDUCE_COUNT) {
+      parser_error(parser, "parser (l: %zu) -> unknown parfor reduction '" SV_FMT "'.\n",
+                   reduction.line, SV_ARG(reduction.lexeme));
+      return (inst_t){.op = OP_PARFOR};
+    }
+
+    token_t body = parser_expect(parser, TOK_IDENTIFIER);
+    token_t end = parser_expect(parser, TOK_IDENTIFIER);
+    parser_push_unresolved_addr(parser, body.lexeme, inst_count, 0);
+    parser_push_unresolved_addr(parser, end.lexeme, inst_count, PARFOR_IP_BITS);
+
+    return (inst_t){.op = OP_PARFOR,
+                    .operand = {.as_u64 = reduce << (2 * PARFOR_IP_BITS)}};
+  }
+
+  if (sv_equals(current.lexeme, SV("open"))) {
+    token_t operand = parser_expect(parser, TOK_STRING);
+    size_t index = parser_push_string(parser, operand.lexeme);
+
+    return (inst_t){.op = OP_OPEN, .operand = {.as_u64 = index}};
+  }
+
   for (size_t i = 0; i < NON_OPERAND_INSTS_COUNT; i++) {
     struct inst_info info = NON_OPERAND_INSTS[i];
     if (sv_equals(current.lexeme, SV(info.lexeme))) {
@@ -116,9 +231,88 @@ inst_t parser_parse_inst(parser_t *parser, size_t inst_count) {
     }
   }  
   
-  fprintf(stderr, "parser (c: %zu) -> invalid instruction has found: '" SV_FMT "'\n",
-          parser->cursor, SV_ARG(current.lexeme));
-  exit(EXIT_FAILURE);
+  parser_error(parser, "parser (c: %zu) -> invalid instruction has found: '" SV_FMT "'\n",
+               parser->cursor, SV_ARG(current.lexeme));
+  return (inst_t){.op = OP_HALT};
+}
+
+// Integers are i64 when negative and u64 otherwise, so the full range of
+// both fits; hex is taken as written. Floats become f64.
+word_t parser_parse_number(parser_t *parser, token_t token) {
+  if (token.kind != TOK_NUMBER && token.kind != TOK_FLOAT) {
+    parser_error(parser, "parser (l: %zu) -> expected a number, found '" SV_FMT "'.\n",
+                 token.line, SV_ARG(token.lexeme));
+    return (word_t){0};
+  }
+
+  char *lexeme = sv_to_cstr(token.lexeme);
+  bool negative = lexeme[0] == '-';
+  const char *digits = lexeme + negative;
+  bool hex = digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X');
+
+  word_t word;
+  char *end;
+  errno = 0;
+  if (token.kind == TOK_FLOAT)
+    word.as_f64 = strtod(lexeme, &end);
+  else if (negative)
+    word.as_i64 = strtoll(lexeme, &end, hex ? 16 : 10);
+  else
+    word.as_u64 = strtoull(lexeme, &end, hex ? 16 : 10);
+
+  // floats may round to inf, integers must fit
+  if (*end != '\0' || (errno == ERANGE && token.kind != TOK_FLOAT)) {
+    parser_error(parser, "parser (l: %zu) -> invalid number literal '%s'.\n", token.line, lexeme);
+    word = (word_t){0};
+  }
+
+  free(lexeme);
+  return word;
+}
+
+uint64_t parser_parse_index(parser_t *parser, token_t token) {
+  if (token.kind != TOK_NUMBER || sv_starts_with(token.lexeme, SV("-"))) {
+    parser_error(parser, "parser (l: %zu) -> expected a non-negative integer, found '" SV_FMT "'.\n",
+                 token.line, SV_ARG(token.lexeme));
+    return 0;
+  }
+
+  return parser_parse_number(parser, token).as_u64;
+}
+
+// import <name> <arity> <results>
+void parser_parse_import(parser_t *parser) {
+  parser_expect(parser, TOK_IDENTIFIER);
+  token_t name = parser_expect(parser, TOK_IDENTIFIER);
+  token_t arity = parser_expect(parser, TOK_NUMBER);
+  token_t results = parser_expect(parser, TOK_NUMBER);
+
+  if (parser->import_count >= parser->import_cap) {
+    parser->import_cap *= 2;
+    parser->imports = realloc(parser->imports, sizeof(honey_import_t) * parser->import_cap);
+  }
+
+  parser->imports[parser->import_count++] = (honey_import_t){
+      .name = sv_to_cstr(name.lexeme),
+      .arity = parser_parse_index(parser, arity),
+      .results = parser_parse_index(parser, results),
+  };
+}
+
+// returns the index of `value` in the string table, adding it if needed
+size_t parser_push_string(parser_t *parser, strview_t value) {
+  for (size_t i = 0; i < parser->string_count; i++) {
+    if (sv_equals(value, SV(parser->strings[i])))
+      return i;
+  }
+
+  if (parser->string_count >= parser->string_cap) {
+    parser->string_cap *= 2;
+    parser->strings = realloc(parser->strings, sizeof(char *) * parser->string_cap);
+  }
+
+  parser->strings[parser->string_count] = sv_to_cstr(value);
+  return parser->string_count++;
 }
 
 void parser_push_label(parser_t *parser, strview_t name, size_t ip) {
@@ -130,13 +324,15 @@ void parser_push_label(parser_t *parser, strview_t name, size_t ip) {
   parser->labels[parser->label_count++] = (label_t){.label = name, .ip = ip};
 }
 
-void parser_push_unresolved_addr(parser_t *parser, strview_t label, size_t ip) {
+void parser_push_unresolved_addr(parser_t *parser, strview_t label, size_t ip,
+                                 unsigned shift) {
   if (parser->unresolved_addr_count >= parser->unresolved_addr_cap) {
     parser->unresolved_addr_cap *= 2;
     parser->unresolved_addrs = realloc(parser->unresolved_addrs, sizeof(label_t) * parser->unresolved_addr_cap);
   }
 
-  parser->unresolved_addrs[parser->unresolved_addr_count++] = (label_t){.label = label, .ip = ip};
+  parser->unresolved_addrs[parser->unresolved_addr_count++] =
+      (label_t){.label = label, .ip = ip, .shift = shift};
 }
 
 label_t parser_get_label(parser_t *parser, strview_t name) {
@@ -146,21 +342,72 @@ label_t parser_get_label(parser_t *parser, strview_t name) {
       return current;
   }
 
-  fprintf(stderr, "parser -> " SV_FMT " is not a valid label.\n", SV_ARG(name));
-  exit(EXIT_FAILURE);
+  parser_error(parser, "parser -> " SV_FMT " is not a valid label.\n", SV_ARG(name));
+  return (label_t){.label = name};
 }
 
 void parser_resolve_addrs(parser_t *parser, inst_t *instructions, size_t inst_count) {
   for (size_t i = 0; i < parser->unresolved_addr_count; i++) {
     label_t unresolved = parser->unresolved_addrs[i];
     label_t label = parser_get_label(parser, unresolved.label);
-    instructions[unresolved.ip].operand.as_u64 = label.ip;
+    if (unresolved.shift > 0 && label.ip > PARFOR_IP_MASK) {
+      parser_error(parser, "parser -> label '" SV_FMT "' is out of parfor range.\n",
+                   SV_ARG(label.label));
+      return;
+    }
+
+    instructions[unresolved.ip].operand.as_u64 |= (uint64_t)label.ip << unresolved.shift;
   }
 }
 
+honey_import_t *parser_imports(parser_t *parser, size_t *out_count) {
+  honey_import_t *imports = calloc(parser->import_count ? parser->import_count : 1,
+                                   sizeof(honey_import_t));
+  for (size_t i = 0; i < parser->import_count; i++) {
+    imports[i] = parser->imports[i];
+    imports[i].name = sv_to_cstr(SV(parser->imports[i].name));
+  }
+
+  *out_count = parser->import_count;
+  return imports;
+}
+
+char **parser_strings(parser_t *parser, size_t *out_count) {
+  char **strings = calloc(parser->string_count ? parser->string_count : 1, sizeof(char *));
+  for (size_t i = 0; i < parser->string_count; i++)
+    strings[i] = sv_to_cstr(SV(parser->strings[i]));
+
+  *out_count = parser->string_count;
+  return strings;
+}
+
+honey_debug_t *parser_debug(parser_t *parser, const char *source_path, size_t inst_count) {
+  honey_debug_t *debug = calloc(1, sizeof(honey_debug_t));
+  debug->source_path = sv_to_cstr(SV(source_path));
+
+  debug->line_count = inst_count;
+  debug->lines = malloc(sizeof(uint32_t) * (inst_count ? inst_count : 1));
+  memcpy(debug->lines, parser->inst_lines, sizeof(uint32_t) * inst_count);
+
+  // labels are pushed while parsing, so they are already sorted by ip
+  debug->label_count = parser->label_count;
+  debug->labels = calloc(parser->label_count ? parser->label_count : 1, sizeof(honey_label_t));
+  for (size_t i = 0; i < parser->label_count; i++) {
+    debug->labels[i].name = sv_to_cstr(parser->labels[i].label);
+    debug->labels[i].ip = parser->labels[i].ip;
+  }
+
+  return debug;
+}
 
 token_t parser_peek(parser_t *parser) { return parser->tokens[parser->cursor]; }
-token_t parser_consume(parser_t *parser) { return parser->tokens[parser->cursor++]; }
+// never moves past the final TOK_EOF, even while recovering from an error
+token_t parser_consume(parser_t *parser) {
+  token_t current = parser->tokens[parser->cursor];
+  if (current.kind != TOK_EOF)
+    parser->cursor++;
+  return current;
+}
 
 token_t parser_expect(parser_t *parser, token_kind_t kind) {
   token_t current = parser_consume(parser);
@@ -168,12 +415,21 @@ token_t parser_expect(parser_t *parser, token_kind_t kind) {
   if (current.kind == kind)
     return current;
 
-  if (current.kind == TOK_EOF) {
-    fprintf(stderr, "parser -> expects %d, but received end of file.\n", kind);
-    exit(EXIT_FAILURE);
-  }
+  if (current.kind == TOK_EOF)
+    parser_error(parser, "parser -> expects %d, but received end of file.\n", kind);
+  else
+    parser_error(parser, "parser -> expects %d, but received %d.\n", kind, current.kind);
+
+  return current;
+}
+
+void parser_error(parser_t *parser, const char *fmt, ...) {
+  if (parser->failed)
+    return;
 
-  fprintf(stderr, "parser -> expects %d, but received %d.\n", kind,
-          current.kind);
-  exit(EXIT_FAILURE);
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  parser->failed = true;
 }
@@ -3,11 +3,16 @@
 #include "lexer.h"
 #include "../lib/sv.h"
 #include "../hvm/honey.h"
+#include "../hvm/program.h"
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
   size_t ip;
   strview_t label;
+  // unresolved addresses only: where the label's ip goes in the operand
+  unsigned shift;
 } label_t;
 
 typedef struct {
@@ -20,7 +25,20 @@ typedef struct {
   label_t *unresolved_addrs;
   size_t unresolved_addr_count, unresolved_addr_cap;
 
+  honey_import_t *imports;
+  size_t import_count, import_cap;
+
+  char **strings;
+  size_t string_count, string_cap;
+
+  uint32_t *inst_lines;
+  size_t current_line;
+
   size_t cursor;
+
+  // set by the first syntax error, which was reported on stderr; parsing
+  // stops there and parser_parse returns NULL
+  bool failed;
 } parser_t;
 
 parser_t *parser_new(token_t *tokens, size_t token_count);
@@ -28,12 +46,25 @@ void parser_free(parser_t *parser);
 
 inst_t *parser_parse(parser_t *parser, size_t *out_size);
 inst_t parser_parse_inst(parser_t *parser, size_t inst_count);
+void parser_parse_import(parser_t *parser);
 
+word_t parser_parse_number(parser_t *parser, token_t token);
+uint64_t parser_parse_index(parser_t *parser, token_t token);
+
+size_t parser_push_string(parser_t *parser, strview_t value);
 void parser_push_label(parser_t *parser, strview_t name, size_t ip);
-void parser_push_unresolved_addr(parser_t *parser, strview_t label, size_t ip);
+void parser_push_unresolved_addr(parser_t *parser, strview_t label, size_t ip,
+                                 unsigned shift);
 label_t parser_get_label(parser_t *parser, strview_t name);
 void parser_resolve_addrs(parser_t *parser, inst_t *instructions, size_t inst_count);
 
+honey_import_t *parser_imports(parser_t *parser, size_t *out_count);
+char **parser_strings(parser_t *parser, size_t *out_count);
+honey_debug_t *parser_debug(parser_t *parser, const char *source_path, size_t inst_count);
+
 token_t parser_peek(parser_t *parser);
 token_t parser_consume(parser_t *parser);
 token_t parser_expect(parser_t *parser, token_kind_t kind);
+
+// Reports a syntax error unless one was already reported, and fails the parse.
+void parser_error(parser_t *parser, const char *fmt, ...);
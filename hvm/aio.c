@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include "aio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define AIO_LOAD(ptr) atomic_load_explicit((_Atomic uint32_t *)(ptr), memory_order_acquire)
+#define AIO_STORE(ptr, value)                                                  \
+  atomic_store_explicit((_Atomic uint32_t *)(ptr), (value), memory_order_release)
+
+static int aio_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int aio_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static void aio_execute(aio_request_t *request) {
+  ssize_t result = 0;
+
+  switch (request->op) {
+  case AIO_OPEN:
+    result = open(request->path, request->flags, 0644);
+    break;
+  case AIO_READ:
+    result = read(request->fd, request->buffer, request->count);
+    break;
+  case AIO_WRITE:
+    result = write(request->fd, request->buffer, request->count);
+    break;
+  case AIO_CLOSE:
+    result = close(request->fd);
+    break;
+  }
+
+  request->result = result < 0 ? -errno : result;
+}
+
+// Pool threads can only be cancelled inside aio_execute, so aio_free can
+// abandon requests stuck on a pipe or terminal without touching the lock.
+static void *aio_pool_thread(void *arg) {
+  aio_t *aio = arg;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+  pthread_mutex_lock(&aio->lock);
+  while (1) {
+    while (!aio->submitted && !aio->stopping)
+      pthread_cond_wait(&aio->work, &aio->lock);
+
+    if (aio->stopping)
+      break;
+
+    aio_request_t *request = aio->submitted;
+    aio->submitted = request->next;
+    pthread_mutex_unlock(&aio->lock);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    aio_execute(request);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    pthread_mutex_lock(&aio->lock);
+    request->next = aio->completed;
+    aio->completed = request;
+    pthread_cond_broadcast(&aio->done);
+  }
+  pthread_mutex_unlock(&aio->lock);
+
+  return NULL;
+}
+
+static bool aio_uring_init(aio_t *aio) {
+  struct io_uring_params params = {0};
+  aio->ring_fd = aio_uring_setup(AIO_ENTRIES, &params);
+  if (aio->ring_fd < 0)
+    return false;
+
+  // reads and writes at the current file position need 5.6+
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(aio->ring_fd);
+    return false;
+  }
+
+  aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (aio->cq_ring_size > aio->sq_ring_size)
+      aio->sq_ring_size = aio->cq_ring_size;
+    aio->cq_ring_size = aio->sq_ring_size;
+  }
+
+  aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+  if (aio->sq_ring == MAP_FAILED)
+    goto fail;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    aio->cq_ring = aio->sq_ring;
+  } else {
+    aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+    if (aio->cq_ring == MAP_FAILED)
+      goto fail_sq;
+  }
+
+  aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+  if (aio->sqes == MAP_FAILED)
+    goto fail_cq;
+
+  uint8_t *sq = aio->sq_ring, *cq = aio->cq_ring;
+  aio->sq_head = (uint32_t *)(sq + params.sq_off.head);
+  aio->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+  aio->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+  aio->sq_array = (uint32_t *)(sq + params.sq_off.array);
+  aio->cq_head = (uint32_t *)(cq + params.cq_off.head);
+  aio->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+  aio->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+  aio->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return true;
+
+fail_cq:
+  if (aio->cq_ring != aio->sq_ring)
+    munmap(aio->cq_ring, aio->cq_ring_size);
+fail_sq:
+  munmap(aio->sq_ring, aio->sq_ring_size);
+fail:
+  close(aio->ring_fd);
+  return false;
+}
+
+aio_t *aio_new(void) {
+  aio_t *aio = calloc(1, sizeof(aio_t));
+  if (!aio)
+    return NULL;
+
+  pthread_mutex_init(&aio->lock, NULL);
+  pthread_cond_init(&aio->work, NULL);
+  pthread_cond_init(&aio->done, NULL);
+
+  aio->uring = aio_uring_init(aio);
+  if (!aio->uring) {
+    for (size_t i = 0; i < AIO_POOL_THREADS; i++)
+      pthread_create(&aio->threads[i], NULL, aio_pool_thread, aio);
+  }
+
+  return aio;
+}
+
+void aio_free(aio_t *aio) {
+  if (!aio)
+    return;
+
+  if (aio->uring) {
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring != aio->sq_ring)
+      munmap(aio->cq_ring, aio->cq_ring_size);
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->ring_fd);
+  } else {
+    pthread_mutex_lock(&aio->lock);
+    aio->stopping = true;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+
+    for (size_t i = 0; i < AIO_POOL_THREADS; i++) {
+      if (aio->pending > 0)
+        pthread_cancel(aio->threads[i]);
+      pthread_join(aio->threads[i], NULL);
+    }
+  }
+
+  pthread_mutex_destroy(&aio->lock);
+  pthread_cond_destroy(&aio->work);
+  pthread_cond_destroy(&aio->done);
+  free(aio);
+}
+
+static void aio_prepare_sqe(struct io_uring_sqe *sqe, aio_request_t *request) {
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = (uint64_t)(uintptr_t)request;
+
+  switch (request->op) {
+  case AIO_OPEN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)request->path;
+    sqe->open_flags = request->flags;
+    sqe->len = 0644;
+    break;
+  case AIO_READ:
+  case AIO_WRITE:
+    sqe->opcode = request->op == AIO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t)(uintptr_t)request->buffer;
+    sqe->len = request->count;
+    sqe->off = (uint64_t)-1;
+    break;
+  case AIO_CLOSE:
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = request->fd;
+    break;
+  }
+}
+
+bool aio_submit(aio_t *aio, aio_request_t *request) {
+  if (aio->pending >= AIO_ENTRIES)
+    return false;
+
+  request->state = AIO_INFLIGHT;
+  request->next = NULL;
+  aio->pending++;
+
+  if (!aio->uring) {
+    pthread_mutex_lock(&aio->lock);
+    request->next = aio->queued;
+    aio->queued = request;
+    pthread_mutex_unlock(&aio->lock);
+    return true;
+  }
+
+  uint32_t tail = *aio->sq_tail;
+  uint32_t index = tail & *aio->sq_mask;
+  aio_prepare_sqe(&aio->sqes[index], request);
+  aio->sq_array[index] = index;
+  AIO_STORE(aio->sq_tail, tail + 1);
+  aio->to_submit++;
+
+  return true;
+}
+
+void aio_flush(aio_t *aio) {
+  if (!aio->uring) {
+    pthread_mutex_lock(&aio->lock);
+    while (aio->queued) {
+      aio_request_t *request = aio->queued;
+      aio->queued = request->next;
+      request->next = aio->submitted;
+      aio->submitted = request;
+    }
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+    return;
+  }
+
+  while (aio->to_submit > 0) {
+    int submitted = aio_uring_enter(aio->ring_fd, aio->to_submit, 0, 0);
+    if (submitted < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      break;
+    }
+
+    if (submitted == 0)
+      break;
+    aio->to_submit -= submitted;
+  }
+}
+
+aio_request_t *aio_poll(aio_t *aio, bool wait) {
+  aio_request_t *completed = NULL;
+  wait = wait && aio->pending > 0;
+
+  if (!aio->uring) {
+    pthread_mutex_lock(&aio->lock);
+    while (wait && !aio->completed)
+      pthread_cond_wait(&aio->done, &aio->lock);
+
+    completed = aio->completed;
+    aio->completed = NULL;
+    pthread_mutex_unlock(&aio->lock);
+
+    for (aio_request_t *request = completed; request; request = request->next) {
+      request->state = AIO_DONE;
+      aio->pending--;
+    }
+
+    return completed;
+  }
+
+  if (wait && AIO_LOAD(aio->cq_tail) == *aio->cq_head) {
+    while (aio_uring_enter(aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+           errno == EINTR)
+      ;
+  }
+
+  uint32_t head = *aio->cq_head;
+  while (head != AIO_LOAD(aio->cq_tail)) {
+    struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+    aio_request_t *request = (aio_request_t *)(uintptr_t)cqe->user_data;
+    head++;
+
+    // no-ops from aio_interrupt carry no request
+    if (!request)
+      continue;
+
+    request->result = cqe->res;
+    request->state = AIO_DONE;
+    request->next = completed;
+    completed = request;
+
+    aio->pending--;
+  }
+  AIO_STORE(aio->cq_head, head);
+
+  return completed;
+}
+
+void aio_wait(aio_t *aio) {
+  if (!aio->uring) {
+    pthread_mutex_lock(&aio->lock);
+    while (!aio->completed && !aio->interrupted)
+      pthread_cond_wait(&aio->done, &aio->lock);
+
+    aio->interrupted = false;
+    pthread_mutex_unlock(&aio->lock);
+    return;
+  }
+
+  if (AIO_LOAD(aio->cq_tail) == AIO_LOAD(aio->cq_head)) {
+    while (aio_uring_enter(aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+           errno == EINTR)
+      ;
+  }
+}
+
+void aio_interrupt(aio_t *aio) {
+  if (!aio->uring) {
+    pthread_mutex_lock(&aio->lock);
+    aio->interrupted = true;
+    pthread_cond_broadcast(&aio->done);
+    pthread_mutex_unlock(&aio->lock);
+    return;
+  }
+
+  // a no-op completion wakes whoever sits in aio_wait
+  uint32_t tail = *aio->sq_tail;
+  if (tail - AIO_LOAD(aio->sq_head) > *aio->sq_mask)
+    return;
+
+  uint32_t index = tail & *aio->sq_mask;
+  memset(&aio->sqes[index], 0, sizeof(struct io_uring_sqe));
+  aio->sqes[index].opcode = IORING_OP_NOP;
+  aio->sq_array[index] = index;
+  AIO_STORE(aio->sq_tail, tail + 1);
+  aio->to_submit++;
+  aio_flush(aio);
+}
+
+int64_t aio_run(aio_t *aio, aio_request_t *request) {
+  if (!aio_submit(aio, request))
+    return -EAGAIN;
+
+  aio_flush(aio);
+  while (request->state != AIO_DONE)
+    aio_poll(aio, true);
+
+  return request->result;
+}
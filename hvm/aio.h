@@ -0,0 +1,83 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AIO_ENTRIES 256
+#define AIO_POOL_THREADS 4
+
+typedef enum aio_op {
+  AIO_OPEN,
+  AIO_READ,
+  AIO_WRITE,
+  AIO_CLOSE,
+} aio_op_t;
+
+typedef enum aio_state {
+  AIO_IDLE = 0,
+  AIO_INFLIGHT,
+  AIO_DONE,
+} aio_state_t;
+
+typedef struct aio_request {
+  aio_op_t op;
+  aio_state_t state;
+
+  int fd, flags;
+  const char *path;
+  void *buffer;
+  size_t count;
+
+  // bytes transferred / new fd, or -errno
+  int64_t result;
+
+  void *owner;
+  struct aio_request *next;
+} aio_request_t;
+
+// Submission is batched: aio_submit only queues, aio_flush hands every
+// queued request to the kernel (io_uring) or to the blocking thread pool
+// used when io_uring is unavailable.
+typedef struct aio {
+  bool uring;
+  size_t pending;
+
+  // io_uring
+  int ring_fd;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+  uint32_t *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  uint32_t to_submit;
+
+  // thread pool fallback
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  pthread_t threads[AIO_POOL_THREADS];
+  aio_request_t *queued, *submitted, *completed;
+  bool stopping, interrupted;
+} aio_t;
+
+aio_t *aio_new(void);
+void aio_free(aio_t *aio);
+
+// false when the submission queue is full; flush and poll, then retry
+bool aio_submit(aio_t *aio, aio_request_t *request);
+void aio_flush(aio_t *aio);
+
+// Collects finished requests into a list linked through `next`. With
+// `wait`, blocks until at least one request completes (if any is pending).
+aio_request_t *aio_poll(aio_t *aio, bool wait);
+
+// Blocks until a completion is ready or aio_interrupt is called, without
+// collecting anything. Safe to call while another thread submits and polls.
+void aio_wait(aio_t *aio);
+void aio_interrupt(aio_t *aio);
+
+// submit + flush + wait for this single request
+int64_t aio_run(aio_t *aio, aio_request_t *request);
@@ -0,0 +1,98 @@
+#include "edge_profile.h"
+#include "program.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static edge_profile_t *edge_profile_alloc(size_t size, uint64_t checksum) {
+  edge_profile_t *profile = calloc(1, sizeof(edge_profile_t));
+  if (!profile)
+    return NULL;
+
+  profile->size = size;
+  profile->checksum = checksum;
+  profile->taken = calloc(size ? size : 1, sizeof(uint64_t));
+  profile->fallthrough = calloc(size ? size : 1, sizeof(uint64_t));
+  if (!profile->taken || !profile->fallthrough) {
+    edge_profile_free(profile);
+    return NULL;
+  }
+
+  return profile;
+}
+
+edge_profile_t *edge_profile_new(const inst_t *code, size_t size) {
+  return edge_profile_alloc(size, honey_program_checksum(code, size));
+}
+
+void edge_profile_free(edge_profile_t *profile) {
+  if (!profile)
+    return;
+
+  free((void *)profile->taken);
+  free((void *)profile->fallthrough);
+  free(profile);
+}
+
+bool edge_profile_write(const edge_profile_t *profile, const char *filepath) {
+  FILE *file = fopen(filepath, "w");
+  if (!file) {
+    fprintf(stderr, "error -> cannot open edge profile output file.\n");
+    return false;
+  }
+
+  fprintf(file, "%s %d\n", EDGE_PROFILE_MAGIC, EDGE_PROFILE_VERSION);
+  fprintf(file, "size %zu\n", profile->size);
+  fprintf(file, "checksum %016" PRIx64 "\n", profile->checksum);
+
+  for (size_t ip = 0; ip < profile->size; ip++) {
+    uint64_t taken = atomic_load_explicit(&profile->taken[ip], memory_order_relaxed);
+    uint64_t fallthrough =
+        atomic_load_explicit(&profile->fallthrough[ip], memory_order_relaxed);
+    if (taken || fallthrough)
+      fprintf(file, "%zu %" PRIu64 " %" PRIu64 "\n", ip, taken, fallthrough);
+  }
+
+  return fclose(file) == 0;
+}
+
+edge_profile_t *edge_profile_read(const char *filepath) {
+  FILE *file = fopen(filepath, "r");
+  if (!file) {
+    fprintf(stderr, "error -> cannot open edge profile '%s'.\n", filepath);
+    return NULL;
+  }
+
+  char magic[32];
+  int version;
+  size_t size;
+  uint64_t checksum;
+  if (fscanf(file, "%31s %d size %zu checksum %" SCNx64, magic, &version, &size,
+             &checksum) != 4 ||
+      strcmp(magic, EDGE_PROFILE_MAGIC) != 0 || version != EDGE_PROFILE_VERSION) {
+    fprintf(stderr, "error -> '%s' is not an edge profile.\n", filepath);
+    fclose(file);
+    return NULL;
+  }
+
+  edge_profile_t *profile = edge_profile_alloc(size, checksum);
+  if (!profile) {
+    fclose(file);
+    return NULL;
+  }
+
+  size_t ip;
+  uint64_t taken, fallthrough;
+  while (fscanf(file, "%zu %" SCNu64 " %" SCNu64, &ip, &taken, &fallthrough) == 3) {
+    if (ip >= size)
+      continue;
+
+    profile->taken[ip] = taken;
+    profile->fallthrough[ip] = fallthrough;
+  }
+
+  fclose(file);
+  return profile;
+}
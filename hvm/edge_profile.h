@@ -0,0 +1,28 @@
+#pragma once
+
+#include "honey.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EDGE_PROFILE_MAGIC "honey-edge-profile"
+#define EDGE_PROFILE_VERSION 1
+
+// Branch counts per instruction, written by `hvm --edge-profile` and read
+// by `hasm --profile-use`. `taken` counts jumps (and spawns) to the operand,
+// `fallthrough` counts conditional branches that were not taken. Block
+// counts follow from these, so straight-line code is never instrumented.
+typedef struct edge_profile {
+  size_t size;
+  uint64_t checksum;
+
+  _Atomic uint64_t *taken;
+  _Atomic uint64_t *fallthrough;
+} edge_profile_t;
+
+edge_profile_t *edge_profile_new(const inst_t *code, size_t size);
+void edge_profile_free(edge_profile_t *profile);
+
+bool edge_profile_write(const edge_profile_t *profile, const char *filepath);
+edge_profile_t *edge_profile_read(const char *filepath);
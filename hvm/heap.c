@@ -0,0 +1,307 @@
+#include "heap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_SIZE sizeof(word_t)
+
+static size_t heap_object_words(object_kind_t kind, size_t length) {
+  size_t words = kind == OBJ_BYTES ? (length + WORD_SIZE - 1) / WORD_SIZE
+                                   : length + (length + 63) / 64;
+
+  // forwarding stores the new address in fields[0], so keep room for it
+  return words ? words : 1;
+}
+
+static size_t heap_object_size(object_kind_t kind, size_t length) {
+  return sizeof(heap_object_t) + WORD_SIZE * heap_object_words(kind, length);
+}
+
+// the field reference bits, right after the fields of an array or record
+static uint64_t *heap_object_refs(const heap_object_t *object) {
+  return (uint64_t *)(uintptr_t)&object->fields[object->length];
+}
+
+static word_t heap_tag(heap_object_t *object) {
+  return (word_t){.as_u64 = (uint64_t)(uintptr_t)object | HEAP_TAG};
+}
+
+static bool heap_space_init(heap_space_t *space, size_t cap) {
+  space->base = malloc(cap);
+  space->starts = calloc(cap / WORD_SIZE / 64 + 1, sizeof(uint64_t));
+  space->top = 0;
+  space->cap = cap;
+
+  if (!space->base || !space->starts) {
+    free(space->base);
+    free(space->starts);
+    memset(space, 0, sizeof(heap_space_t));
+    return false;
+  }
+
+  return true;
+}
+
+static void heap_space_free(heap_space_t *space) {
+  free(space->base);
+  free(space->starts);
+  memset(space, 0, sizeof(heap_space_t));
+}
+
+static void heap_space_clear(heap_space_t *space) {
+  memset(space->starts, 0, (space->top / WORD_SIZE / 64 + 1) * sizeof(uint64_t));
+  space->top = 0;
+}
+
+static bool heap_space_has_object(const heap_space_t *space, uintptr_t address) {
+  uintptr_t base = (uintptr_t)space->base;
+  if (address < base || address >= base + space->top)
+    return false;
+
+  size_t word = (address - base) / WORD_SIZE;
+  return (space->starts[word / 64] >> (word % 64)) & 1;
+}
+
+static heap_object_t *heap_space_bump(heap_space_t *space, size_t size) {
+  size_t word = space->top / WORD_SIZE;
+  space->starts[word / 64] |= 1ull << (word % 64);
+
+  heap_object_t *object = (heap_object_t *)(space->base + space->top);
+  space->top += size;
+  return object;
+}
+
+heap_t *heap_new(void) {
+  heap_t *heap = calloc(1, sizeof(heap_t));
+  if (!heap)
+    return NULL;
+
+  if (!heap_space_init(&heap->nursery, HEAP_NURSERY_SIZE)) {
+    free(heap);
+    return NULL;
+  }
+
+  heap->old_target = HEAP_OLD_INIT;
+  return heap;
+}
+
+void heap_free(heap_t *heap) {
+  if (!heap)
+    return;
+
+  heap_space_free(&heap->nursery);
+  heap_space_free(&heap->old);
+  free(heap->remembered);
+  free(heap);
+}
+
+void heap_reset(heap_t *heap) {
+  heap_space_clear(&heap->nursery);
+  if (heap->old.base)
+    heap_space_clear(&heap->old);
+  heap->remembered_count = 0;
+}
+
+heap_object_t *heap_deref(const heap_t *heap, word_t word) {
+  if (!heap || (word.as_u64 & (WORD_SIZE - 1)) != HEAP_TAG)
+    return NULL;
+
+  uintptr_t address = (uintptr_t)(word.as_u64 & ~(uint64_t)HEAP_TAG);
+  if (heap_space_has_object(&heap->nursery, address) ||
+      heap_space_has_object(&heap->old, address))
+    return (heap_object_t *)address;
+
+  return NULL;
+}
+
+const heap_object_t *heap_deref_readable(const honey_t *vm, word_t word) {
+  heap_object_t *object = heap_deref(vm->heap, word);
+  if (!object && vm->shared_heap)
+    object = heap_deref(vm->shared_heap, word);
+
+  return object;
+}
+
+word_t heap_object_get(const heap_object_t *object, size_t index) {
+  if (object->kind == OBJ_BYTES)
+    return (word_t){.as_u64 = ((const uint8_t *)object->fields)[index]};
+
+  return object->fields[index];
+}
+
+bool heap_object_is_ref(const heap_object_t *object, size_t index) {
+  if (object->kind == OBJ_BYTES)
+    return false;
+
+  return (heap_object_refs(object)[index / 64] >> (index % 64)) & 1;
+}
+
+void heap_object_set(heap_t *heap, heap_object_t *object, size_t index, word_t value,
+                     bool is_ref) {
+  if (object->kind == OBJ_BYTES) {
+    ((uint8_t *)object->fields)[index] = (uint8_t)value.as_u64;
+    return;
+  }
+
+  uint64_t *refs = heap_object_refs(object);
+  if (is_ref) {
+    heap_write_barrier(heap, object, value);
+    refs[index / 64] |= 1ull << (index % 64);
+  } else {
+    refs[index / 64] &= ~(1ull << (index % 64));
+  }
+
+  object->fields[index] = value;
+}
+
+void heap_write_barrier(heap_t *heap, heap_object_t *object, word_t value) {
+  if (object->remembered ||
+      heap_space_has_object(&heap->nursery, (uintptr_t)object))
+    return;
+
+  heap_object_t *target = heap_deref(heap, value);
+  if (!target || !heap_space_has_object(&heap->nursery, (uintptr_t)target))
+    return;
+
+  if (heap->remembered_count >= heap->remembered_cap) {
+    heap->remembered_cap = heap->remembered_cap ? heap->remembered_cap * 2 : 64;
+    heap->remembered = realloc(heap->remembered,
+                               sizeof(heap_object_t *) * heap->remembered_cap);
+  }
+
+  object->remembered = 1;
+  heap->remembered[heap->remembered_count++] = object;
+}
+
+// Copies the object behind `slot` into `to` (unless it was already moved)
+// and rewrites the slot. Minor collections only move nursery objects.
+static void heap_forward(heap_t *heap, heap_space_t *to, word_t *slot,
+                         bool major) {
+  heap_object_t *object = heap_deref(heap, *slot);
+  if (!object)
+    return;
+
+  if (!major && !heap_space_has_object(&heap->nursery, (uintptr_t)object))
+    return;
+
+  if (object->kind == OBJ_FORWARD) {
+    *slot = heap_tag(object->fields[0].as_ptr);
+    return;
+  }
+
+  size_t size = heap_object_size(object->kind, object->length);
+  heap_object_t *copy = heap_space_bump(to, size);
+  memcpy(copy, object, size);
+  copy->remembered = 0;
+
+  object->kind = OBJ_FORWARD;
+  object->fields[0].as_ptr = copy;
+  *slot = heap_tag(copy);
+}
+
+static void heap_scan(heap_t *heap, heap_space_t *to, size_t scan, bool major) {
+  while (scan < to->top) {
+    heap_object_t *object = (heap_object_t *)(to->base + scan);
+    if (object->kind != OBJ_BYTES) {
+      for (size_t i = 0; i < object->length; i++) {
+        if (heap_object_is_ref(object, i))
+          heap_forward(heap, to, &object->fields[i], major);
+      }
+    }
+
+    scan += heap_object_size(object->kind, object->length);
+  }
+}
+
+void heap_collect_minor(honey_t *vm) {
+  heap_t *heap = vm->heap;
+  size_t old_limit = heap->old.cap < heap->old_target ? heap->old.cap : heap->old_target;
+
+  // promotion needs room for every nursery object in the worst case
+  if (heap->old.top + heap->nursery.top > old_limit) {
+    heap_collect_major(vm, 0);
+    return;
+  }
+
+  size_t scan = heap->old.top;
+  for (size_t i = 0; i < vm->sp; i++) {
+    if (honey_stack_is_ref(vm, i))
+      heap_forward(heap, &heap->old, &vm->stack[i], false);
+  }
+
+  for (size_t i = 0; i < heap->remembered_count; i++) {
+    heap_object_t *object = heap->remembered[i];
+    object->remembered = 0;
+    for (size_t j = 0; j < object->length; j++) {
+      if (heap_object_is_ref(object, j))
+        heap_forward(heap, &heap->old, &object->fields[j], false);
+    }
+  }
+
+  heap_scan(heap, &heap->old, scan, false);
+
+  heap->remembered_count = 0;
+  heap_space_clear(&heap->nursery);
+  heap->minor_count++;
+}
+
+void heap_collect_major(honey_t *vm, size_t reserve) {
+  heap_t *heap = vm->heap;
+
+  size_t worst = heap->old.top + heap->nursery.top + reserve;
+  heap_space_t to;
+  if (!heap_space_init(&to, worst > heap->old_target ? worst : heap->old_target))
+    return;
+
+  for (size_t i = 0; i < vm->sp; i++) {
+    if (honey_stack_is_ref(vm, i))
+      heap_forward(heap, &to, &vm->stack[i], true);
+  }
+
+  heap_scan(heap, &to, 0, true);
+
+  heap_space_free(&heap->old);
+  heap->old = to;
+  heap->remembered_count = 0;
+  heap_space_clear(&heap->nursery);
+
+  size_t live = heap->old.top + reserve;
+  heap->old_target = 2 * live > HEAP_OLD_INIT ? 2 * live : HEAP_OLD_INIT;
+  heap->major_count++;
+}
+
+err_code_t heap_alloc(honey_t *vm, object_kind_t kind, size_t length,
+                      word_t *out) {
+  if (!vm->heap && !(vm->heap = heap_new()))
+    return ERR_OUT_OF_MEMORY;
+
+  // fields, their reference bits and the header must not overflow size_t
+  if (length > (SIZE_MAX - sizeof(heap_object_t)) / WORD_SIZE / 2 - 1)
+    return ERR_OUT_OF_MEMORY;
+
+  heap_t *heap = vm->heap;
+  size_t size = heap_object_size(kind, length);
+  heap_space_t *space;
+
+  if (size <= heap->nursery.cap / 2) {
+    space = &heap->nursery;
+    if (space->top + size > space->cap)
+      heap_collect_minor(vm);
+  } else {
+    // large objects skip the nursery instead of being copied on promotion
+    space = &heap->old;
+    if (space->top + size > space->cap)
+      heap_collect_major(vm, size);
+  }
+
+  if (space->top + size > space->cap)
+    return ERR_OUT_OF_MEMORY;
+
+  heap_object_t *object = heap_space_bump(space, size);
+  memset(object, 0, size);
+  object->kind = kind;
+  object->length = length;
+
+  *out = heap_tag(object);
+  return ERR_OK;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "honey.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HEAP_NURSERY_SIZE (256 * 1024)
+#define HEAP_OLD_INIT (1024 * 1024)
+
+// References are object addresses with the low bit set. Objects are 8-byte
+// aligned and every allocation is recorded in a per-space start bitmap, so
+// a word only derefs when it is tagged and lands exactly on a live object
+// start. Whether a slot holds a reference is tracked apart from its value
+// (honey_t.stack_refs and the field bits of arrays and records): the
+// collector only follows and rewrites those slots, never an integer that
+// happens to equal an object's address.
+#define HEAP_TAG 0x1
+
+typedef enum object_kind {
+  OBJ_ARRAY = 1,
+  OBJ_RECORD,
+  OBJ_BYTES,
+  OBJ_FORWARD,
+} object_kind_t;
+
+// `length` counts fields, or bytes for OBJ_BYTES whose payload is raw data
+// and never scanned for references. Arrays and records keep one bit per
+// field after the fields, set when that field holds a reference.
+typedef struct heap_object {
+  uint32_t kind;
+  uint32_t remembered;
+  uint64_t length;
+  word_t fields[];
+} heap_object_t;
+
+typedef struct heap_space {
+  uint8_t *base;
+  size_t top, cap;
+  uint64_t *starts;
+} heap_space_t;
+
+// Generational copying heap: objects are bump allocated in the nursery,
+// survivors of a minor collection are promoted to the old space, and a
+// major collection copies the old space into a fresh one. Roots are the
+// reference slots on the owning vm's stack plus old objects remembered by
+// the write barrier.
+typedef struct heap {
+  heap_space_t nursery, old;
+  size_t old_target;
+
+  heap_object_t **remembered;
+  size_t remembered_count, remembered_cap;
+
+  uint64_t minor_count, major_count;
+} heap_t;
+
+heap_t *heap_new(void);
+void heap_free(heap_t *heap);
+void heap_reset(heap_t *heap);
+
+err_code_t heap_alloc(honey_t *vm, object_kind_t kind, size_t length,
+                      word_t *out);
+heap_object_t *heap_deref(const heap_t *heap, word_t word);
+// the vm's own objects, or its parent's when it runs a parfor body
+const heap_object_t *heap_deref_readable(const honey_t *vm, word_t word);
+word_t heap_object_get(const heap_object_t *object, size_t index);
+bool heap_object_is_ref(const heap_object_t *object, size_t index);
+void heap_object_set(heap_t *heap, heap_object_t *object, size_t index, word_t value,
+                     bool is_ref);
+void heap_write_barrier(heap_t *heap, heap_object_t *object, word_t value);
+
+void heap_collect_minor(honey_t *vm);
+void heap_collect_major(honey_t *vm, size_t reserve);
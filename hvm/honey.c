@@ -1,23 +1,132 @@
+#define _GNU_SOURCE
 #include "honey.h"
+#include "aio.h"
+#include "edge_profile.h"
+#include "heap.h"
+#include "parfor.h"
+#include "sched.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define BINARY_OPI(op)                                                         \
-  {                                                                         \
+#define BINARY_OP(in, out, op)                                                 \
+  {                                                                            \
     word_t a, b;                                                               \
     err_code_t res_a = honey_stack_pop(vm, &a);                                \
     err_code_t res_b = honey_stack_pop(vm, &b);                                \
     PANIC_ASSERT(vm, res_a, current);                                          \
     PANIC_ASSERT(vm, res_b, current);                                          \
     err_code_t push_res =                                                      \
-        honey_stack_push(vm, (word_t){.as_i64 = b.as_i64 op a.as_i64});        \
+        honey_stack_push(vm, (word_t){.out = b.in op a.in});                   \
     PANIC_ASSERT(vm, push_res, current);                                       \
     break;                                                                     \
   }
 
+#define BINARY_OPI(op) BINARY_OP(as_i64, as_i64, op)
+#define BINARY_OPU(op) BINARY_OP(as_u64, as_u64, op)
+#define BINARY_OPF(op) BINARY_OP(as_f64, as_f64, op)
+
+// A zero divisor panics instead of trapping the host. INT64_MIN / -1 wraps
+// to `overflow` (INT64_MIN for divi, 0 for modi) like two's complement.
+#define DIVISION_OP(in, op, wraps, overflow)                                   \
+  {                                                                            \
+    word_t a, b;                                                               \
+    err_code_t res_a = honey_stack_pop(vm, &a);                                \
+    err_code_t res_b = honey_stack_pop(vm, &b);                                \
+    PANIC_ASSERT(vm, res_a, current);                                          \
+    PANIC_ASSERT(vm, res_b, current);                                          \
+    if (a.in == 0) {                                                           \
+      honey_panic(vm, ERR_DIVISION_BY_ZERO, &current);                         \
+      return ERR_DIVISION_BY_ZERO;                                             \
+    }                                                                          \
+                                                                               \
+    word_t result;                                                             \
+    if (wraps)                                                                 \
+      result.as_i64 = overflow;                                                \
+    else                                                                       \
+      result.in = b.in op a.in;                                                \
+                                                                               \
+    err_code_t push_res = honey_stack_push(vm, result);                        \
+    PANIC_ASSERT(vm, push_res, current);                                       \
+    break;                                                                     \
+  }
+
+#define DIVISION_OPI(op, overflow)                                             \
+  DIVISION_OP(as_i64, op, a.as_i64 == -1 && b.as_i64 == INT64_MIN, overflow)
+#define DIVISION_OPU(op) DIVISION_OP(as_u64, op, false, 0)
+
+// comparisons push an i64 0 or 1 whatever they compare, so jz/jnz and
+// noti work on their result
+#define COMPARE_OPU(op) BINARY_OP(as_u64, as_i64, op)
+#define COMPARE_OPF(op) BINARY_OP(as_f64, as_i64, op)
+
+#define CONVERT_OP(in, out, convert)                                           \
+  {                                                                            \
+    if (vm->sp == 0) {                                                         \
+      honey_panic(vm, ERR_STACK_UNDERFLOW, &current);                          \
+      return ERR_STACK_UNDERFLOW;                                              \
+    }                                                                          \
+                                                                               \
+    word_t *word = &vm->stack[vm->sp - 1];                                     \
+    *word = (word_t){.out = convert(word->in)};                                \
+    honey_stack_set_ref(vm, vm->sp - 1, false);                                \
+    break;                                                                     \
+  }
+
+#define SCHED_ASSERT(vm, inst)                                                 \
+  do {                                                                         \
+    if (!vm->sched) {                                                          \
+      honey_panic(vm, ERR_NO_SCHEDULER, &inst);                                \
+      return ERR_NO_SCHEDULER;                                                 \
+    }                                                                          \
+  } while (false)
+
+// A blocking instruction that could not complete is re-executed on wake up,
+// so it must leave the stack untouched before suspending.
+#define SUSPEND_IF_BLOCKED(vm)                                                 \
+  if (vm->state == HONEY_BLOCKED) {                                            \
+    vm->ip--;                                                                  \
+    return ERR_OK;                                                             \
+  }
+
+#define PREEMPT_CHECK(vm)                                                      \
+  if (vm->preempt_at && vm->executed_count >= vm->preempt_at) {                \
+    vm->state = HONEY_YIELDED;                                                 \
+    return ERR_OK;                                                             \
+  }
+
+// counts the branch that was just fetched, see edge_profile.h
+#define EDGE_COUNT(vm, counts)                                                 \
+  if (vm->edges)                                                               \
+    atomic_fetch_add_explicit(&vm->edges->counts[vm->ip - 1], 1,               \
+                              memory_order_relaxed);
+
+// Records the fetched instruction; a replay that has to stop in front of
+// it puts it back.
+#define TRACE_STEP(vm, current)                                                \
+  if (vm->trace && !trace_step(vm->trace, vm->ip - 1, current.op)) {           \
+    vm->ip--;                                                                  \
+    vm->executed_count--;                                                      \
+    vm->state = HONEY_YIELDED;                                                 \
+    return ERR_OK;                                                             \
+  }
+
+#define TRACE_BRANCH(vm, taken)                                                \
+  if (vm->trace)                                                               \
+    trace_branch(vm->trace, taken);
+
+// Jumps stay inside the program; a parfor body may also jump to its end
+// label, which finishes the iteration.
+#define JUMP_OUT_OF_RANGE(vm, target)                                          \
+  ((target) >= (vm)->program_size &&                                           \
+   !((vm)->in_parfor && (target) == (vm)->program_size))
+
 #define PANIC_ASSERT(vm, res, inst)                                            \
   do {                                                                         \
     if (res != ERR_OK) {                                                       \
@@ -36,12 +145,32 @@ honey_t *honey_new(inst_t *program, size_t program_size) {
   return vm;
 }
 
-void honey_free(honey_t *vm) { free(vm); }
+void honey_free(honey_t *vm) {
+  heap_free(vm->heap);
+  aio_free(vm->aio);
+  free(vm->io);
+  free(vm);
+}
+
+void honey_reset(honey_t *vm) {
+  memset(vm->stack, 0, sizeof(word_t) * vm->sp);
+  vm->sp = 0;
+  vm->ip = 0;
+  vm->executed_count = 0;
+  vm->state = HONEY_RUNNING;
+  if (vm->heap)
+    heap_reset(vm->heap);
+}
 
 err_code_t honey_stack_push(honey_t *vm, word_t value) {
+  return honey_stack_push_ref(vm, value, false);
+}
+
+err_code_t honey_stack_push_ref(honey_t *vm, word_t value, bool is_ref) {
   if (vm->sp >= STACK_MAX)
     return ERR_STACK_OVERFLOW;
 
+  honey_stack_set_ref(vm, vm->sp, is_ref);
   vm->stack[vm->sp++] = value;
   return ERR_OK;
 }
@@ -54,6 +183,17 @@ err_code_t honey_stack_pop(honey_t *vm, word_t *out) {
   return ERR_OK;
 }
 
+bool honey_stack_is_ref(const honey_t *vm, size_t index) {
+  return (vm->stack_refs[index / 64] >> (index % 64)) & 1;
+}
+
+void honey_stack_set_ref(honey_t *vm, size_t index, bool is_ref) {
+  if (is_ref)
+    vm->stack_refs[index / 64] |= 1ull << (index % 64);
+  else
+    vm->stack_refs[index / 64] &= ~(1ull << (index % 64));
+}
+
 const char *honey_error_cstr(err_code_t code) {
   switch (code) {
   case ERR_OK:
@@ -66,21 +206,208 @@ const char *honey_error_cstr(err_code_t code) {
     return "Illegal stack access out of bounds";
   case ERR_INST_ILLEGAL_ACCESS:
     return "Illegal program memory access: out-of-bounds read or jump";
+  case ERR_INVALID_REQUEST:
+    return "Invalid request: expected whitespace separated integers";
+  case ERR_NO_SCHEDULER:
+    return "Concurrency instruction used outside of a scheduler";
+  case ERR_INVALID_HANDLE:
+    return "Invalid fiber or channel handle";
+  case ERR_DEADLOCK:
+    return "Deadlock: every live fiber is blocked";
+  case ERR_OUT_OF_MEMORY:
+    return "Out of memory";
+  case ERR_INVALID_REF:
+    return "Invalid heap reference";
+  case ERR_INDEX_OUT_OF_BOUNDS:
+    return "Field index out of bounds";
+  case ERR_SHARED_REF:
+    return "Heap object belongs to another vm: fibers cannot share references and parfor bodies cannot write the parent's objects";
+  case ERR_INVALID_NATIVE:
+    return "Call to an unbound native function";
+  case ERR_NATIVE_FAILURE:
+    return "Native function failed";
+  case ERR_INVALID_STRING:
+    return "Invalid string constant";
+  case ERR_INVALID_MODE:
+    return "Invalid open mode: expected 0 (read), 1 (write) or 2 (append)";
+  case ERR_DIVISION_BY_ZERO:
+    return "Division by zero";
+  case ERR_INVALID_PARFOR:
+    return "Invalid parfor: bad body range or reduction, nested in a parfor body, or no worker pool";
   default:
     return "Unknown error.";
   }
 }
 
-void honey_stack_dump(const honey_t *vm) {
-  printf("Stack:\n");
+const char *honey_inst_cstr(inst_op_t op) {
+  switch (op) {
+  case OP_PUSH:
+    return "push";
+  case OP_PLUSI:
+    return "plusi";
+  case OP_MINUSI:
+    return "minusi";
+  case OP_DIVI:
+    return "divi";
+  case OP_MULTI:
+    return "multi";
+  case OP_MODI:
+    return "modi";
+  case OP_GTI:
+    return "gti";
+  case OP_GTEI:
+    return "gtei";
+  case OP_LTI:
+    return "lti";
+  case OP_LTEI:
+    return "ltei";
+  case OP_EQI:
+    return "eqi";
+  case OP_NEQI:
+    return "neqi";
+  case OP_NOTI:
+    return "noti";
+  case OP_JMP:
+    return "jmp";
+  case OP_JZ:
+    return "jz";
+  case OP_JNZ:
+    return "jnz";
+  case OP_DUP:
+    return "dup";
+  case OP_DUMP:
+    return "dump";
+  case OP_HALT:
+    return "halt";
+  case OP_SPAWN:
+    return "spawn";
+  case OP_YIELD:
+    return "yield";
+  case OP_JOIN:
+    return "join";
+  case OP_CHAN:
+    return "chan";
+  case OP_SEND:
+    return "send";
+  case OP_RECV:
+    return "recv";
+  case OP_ALLOC:
+    return "alloc";
+  case OP_RECORD:
+    return "record";
+  case OP_GETF:
+    return "getf";
+  case OP_SETF:
+    return "setf";
+  case OP_LEN:
+    return "len";
+  case OP_CALLNATIVE:
+    return "callnative";
+  case OP_BYTES:
+    return "bytes";
+  case OP_OPEN:
+    return "open";
+  case OP_READ:
+    return "read";
+  case OP_WRITE:
+    return "write";
+  case OP_CLOSE:
+    return "close";
+  case OP_PLUSU:
+    return "plusu";
+  case OP_MINUSU:
+    return "minusu";
+  case OP_DIVU:
+    return "divu";
+  case OP_MULTU:
+    return "multu";
+  case OP_MODU:
+    return "modu";
+  case OP_GTU:
+    return "gtu";
+  case OP_GTEU:
+    return "gteu";
+  case OP_LTU:
+    return "ltu";
+  case OP_LTEU:
+    return "lteu";
+  case OP_PLUSF:
+    return "plusf";
+  case OP_MINUSF:
+    return "minusf";
+  case OP_DIVF:
+    return "divf";
+  case OP_MULTF:
+    return "multf";
+  case OP_MODF:
+    return "modf";
+  case OP_GTF:
+    return "gtf";
+  case OP_GTEF:
+    return "gtef";
+  case OP_LTF:
+    return "ltf";
+  case OP_LTEF:
+    return "ltef";
+  case OP_EQF:
+    return "eqf";
+  case OP_NEQF:
+    return "neqf";
+  case OP_ITOF:
+    return "itof";
+  case OP_FTOI:
+    return "ftoi";
+  case OP_UTOF:
+    return "utof";
+  case OP_FTOU:
+    return "ftou";
+  case OP_DUMPI:
+    return "dumpi";
+  case OP_DUMPU:
+    return "dumpu";
+  case OP_DUMPF:
+    return "dumpf";
+  case OP_PARFOR:
+    return "parfor";
+  default:
+    return "unknown";
+  }
+}
+
+uint32_t honey_debug_locate(const honey_debug_t *debug, size_t ip,
+                            const honey_label_t **out_label) {
+  *out_label = NULL;
+  if (!debug || ip >= debug->line_count)
+    return 0;
+
+  // labels are sorted by ip, pick the last one at or before `ip`
+  size_t lo = 0, hi = debug->label_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (debug->labels[mid].ip <= ip)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo > 0)
+    *out_label = &debug->labels[lo - 1];
+
+  return debug->lines[ip];
+}
+
+void honey_stack_dump(const honey_t *vm) { honey_stack_fdump(vm, stdout); }
+
+void honey_stack_fdump(const honey_t *vm, FILE *out) {
+  fprintf(out, "Stack:\n");
 
   if (vm->sp <= 0) {
-    printf("  [ empty ]\n");
+    fprintf(out, "  [ empty ]\n");
   } else {
     for (size_t i = 0; i < vm->sp; i++) {
       word_t word = vm->stack[i];
-      printf("  i64: %ld, u64: %lu, f64: %lf, ptr: %p\n", word.as_i64,
-             word.as_u64, word.as_f64, word.as_ptr);
+      fprintf(out, "  i64: %ld, u64: %lu, f64: %lf, ptr: %p\n", word.as_i64,
+              word.as_u64, word.as_f64, word.as_ptr);
     }
   }
 }
@@ -89,23 +416,131 @@ void honey_panic(const honey_t *vm, err_code_t code, const inst_t *current) {
   fprintf(stderr, "\n[VM ERROR] %s\n", honey_error_cstr(code));
 
   if (current)
-    fprintf(stderr, "  -> Instruction: (operand=%ld)\n",
-            current->operand.as_i64);
+    fprintf(stderr, "  -> Instruction: %s (operand=%ld)\n",
+            honey_inst_cstr(current->op), current->operand.as_i64);
+
+  const honey_label_t *label;
+  size_t current_ip = vm->ip > 0 ? vm->ip - 1 : 0;
+  uint32_t line = honey_debug_locate(vm->debug, current_ip, &label);
+  if (line > 0) {
+    fprintf(stderr, "  -> Source: %s:%u", vm->debug->source_path, line);
+    if (label)
+      fprintf(stderr, " (%s+%zu)", label->name, current_ip - label->ip);
+    fprintf(stderr, "\n");
+  }
 
   fprintf(stderr, "  IP=%zu, SP=%zu\n", vm->ip, vm->sp);
 
-  honey_stack_dump(vm);
+  honey_stack_fdump(vm, stderr);
   fprintf(stderr, "\n");
 }
 
+// Float to integer conversions saturate at the range ends and map NaN to
+// 0, where a plain C cast would be undefined.
+static int64_t honey_f64_to_i64(double value) {
+  if (isnan(value))
+    return 0;
+  if (value >= 0x1p63)
+    return INT64_MAX;
+  if (value < -0x1p63)
+    return INT64_MIN;
+  return (int64_t)value;
+}
+
+static uint64_t honey_f64_to_u64(double value) {
+  if (isnan(value) || value <= 0)
+    return 0;
+  if (value >= 0x1p64)
+    return UINT64_MAX;
+  return (uint64_t)value;
+}
+
+void honey_format_word(char *buffer, size_t size, word_t word, honey_type_t type) {
+  switch (type) {
+  case HONEY_TYPE_U64:
+    snprintf(buffer, size, "%lu", word.as_u64);
+    return;
+  case HONEY_TYPE_F64:
+    for (int precision = 1; precision < 17; precision++) {
+      snprintf(buffer, size, "%.*g", precision, word.as_f64);
+      if (strtod(buffer, NULL) == word.as_f64)
+        return;
+    }
+
+    snprintf(buffer, size, "%.17g", word.as_f64);
+    return;
+  default:
+    snprintf(buffer, size, "%ld", word.as_i64);
+    return;
+  }
+}
+
+void honey_dump_word(honey_t *vm, word_t word, honey_type_t type) {
+  if (vm->on_dump) {
+    vm->on_dump(vm, word, type);
+    return;
+  }
+
+  if (type == HONEY_TYPE_WORD) {
+    printf("  i64: %ld, u64: %lu, f64: %lf, ptr: %p\n", word.as_i64,
+           word.as_u64, word.as_f64, word.as_ptr);
+    return;
+  }
+
+  char buffer[32];
+  honey_format_word(buffer, sizeof(buffer), word, type);
+  printf("  %s: %s\n", type == HONEY_TYPE_I64   ? "i64"
+                       : type == HONEY_TYPE_U64 ? "u64"
+                                                : "f64",
+         buffer);
+}
+
+// Completes `prepared` and stores its result in `out`. Fibers submit it to
+// the scheduler and come back BLOCKED; the instruction re-executes once the
+// completion wakes them and then finds the request done.
+static err_code_t honey_io(honey_t *vm, const aio_request_t *prepared,
+                           int64_t *out) {
+  if (!vm->io && !(vm->io = calloc(1, sizeof(aio_request_t))))
+    return ERR_OUT_OF_MEMORY;
+
+  aio_request_t *request = vm->io;
+  if (vm->sched) {
+    if (request->state == AIO_DONE) {
+      request->state = AIO_IDLE;
+      *out = request->result;
+      return ERR_OK;
+    }
+
+    *request = *prepared;
+    return sched_io(vm->sched, vm, request);
+  }
+
+  if (!vm->aio && !(vm->aio = aio_new()))
+    return ERR_OUT_OF_MEMORY;
+
+  *request = *prepared;
+  *out = aio_run(vm->aio, request);
+  request->state = AIO_IDLE;
+  return ERR_OK;
+}
+
 err_code_t honey_interpret(honey_t *vm) {
   while (1) {
     if (vm->ip >= vm->program_size) {
+      // a parfor body ends where its range ends
+      if (vm->in_parfor && vm->ip == vm->program_size) {
+        vm->state = HONEY_HALTED;
+        return ERR_OK;
+      }
+
       honey_panic(vm, ERR_INST_ILLEGAL_ACCESS, NULL);
       return ERR_INST_ILLEGAL_ACCESS;
     }
 
     inst_t current = vm->program[vm->ip++];
+    vm->executed_count++;
+    TRACE_STEP(vm, current);
+
     switch (current.op) {
     case OP_PUSH: {
       err_code_t res = honey_stack_push(vm, current.operand);
@@ -114,15 +549,49 @@ err_code_t honey_interpret(honey_t *vm) {
     }
     case OP_PLUSI: BINARY_OPI(+);
     case OP_MINUSI: BINARY_OPI(-);
-    case OP_DIVI: BINARY_OPI(/);
+    case OP_DIVI: DIVISION_OPI(/, INT64_MIN);
     case OP_MULTI: BINARY_OPI(*);
-    case OP_MODI: BINARY_OPI(%);
+    case OP_MODI: DIVISION_OPI(%, 0);
     case OP_LTI: BINARY_OPI(<);
     case OP_LTEI: BINARY_OPI(<=);
     case OP_GTI: BINARY_OPI(>);
     case OP_GTEI: BINARY_OPI(>=);
     case OP_EQI: BINARY_OPI(==);
     case OP_NEQI: BINARY_OPI(!=);
+    case OP_PLUSU: BINARY_OPU(+);
+    case OP_MINUSU: BINARY_OPU(-);
+    case OP_DIVU: DIVISION_OPU(/);
+    case OP_MULTU: BINARY_OPU(*);
+    case OP_MODU: DIVISION_OPU(%);
+    case OP_GTU: COMPARE_OPU(>);
+    case OP_GTEU: COMPARE_OPU(>=);
+    case OP_LTU: COMPARE_OPU(<);
+    case OP_LTEU: COMPARE_OPU(<=);
+    case OP_PLUSF: BINARY_OPF(+);
+    case OP_MINUSF: BINARY_OPF(-);
+    case OP_DIVF: BINARY_OPF(/);
+    case OP_MULTF: BINARY_OPF(*);
+    case OP_MODF: {
+      word_t a, b;
+      err_code_t res_a = honey_stack_pop(vm, &a);
+      err_code_t res_b = honey_stack_pop(vm, &b);
+      PANIC_ASSERT(vm, res_a, current);
+      PANIC_ASSERT(vm, res_b, current);
+
+      err_code_t res = honey_stack_push(vm, (word_t){.as_f64 = fmod(b.as_f64, a.as_f64)});
+      PANIC_ASSERT(vm, res, current);
+      break;
+    }
+    case OP_GTF: COMPARE_OPF(>);
+    case OP_GTEF: COMPARE_OPF(>=);
+    case OP_LTF: COMPARE_OPF(<);
+    case OP_LTEF: COMPARE_OPF(<=);
+    case OP_EQF: COMPARE_OPF(==);
+    case OP_NEQF: COMPARE_OPF(!=);
+    case OP_ITOF: CONVERT_OP(as_i64, as_f64, (double));
+    case OP_UTOF: CONVERT_OP(as_u64, as_f64, (double));
+    case OP_FTOI: CONVERT_OP(as_f64, as_i64, honey_f64_to_i64);
+    case OP_FTOU: CONVERT_OP(as_f64, as_u64, honey_f64_to_u64);
     case OP_NOTI: {
       word_t word;
       err_code_t res = honey_stack_pop(vm, &word);
@@ -141,28 +610,40 @@ err_code_t honey_interpret(honey_t *vm) {
       }
 
       word_t word = vm->stack[current.operand.as_u64];
-      err_code_t res = honey_stack_push(vm, word);
+      bool is_ref = honey_stack_is_ref(vm, current.operand.as_u64);
+      err_code_t res = honey_stack_push_ref(vm, word, is_ref);
       PANIC_ASSERT(vm, res, current);
       
       break;
     }
-    case OP_DUMP: {
+    case OP_DUMP:
+    case OP_DUMPI:
+    case OP_DUMPU:
+    case OP_DUMPF: {
       word_t word;
       err_code_t res = honey_stack_pop(vm, &word);
       PANIC_ASSERT(vm, res, current);
-      
-      printf("  i64: %ld, u64: %lu, f64: %lf, ptr: %p\n", word.as_i64,
-             word.as_u64, word.as_f64, word.as_ptr);
+
+      if (vm->trace)
+        trace_words(vm->trace, &word, 1);
+
+      honey_type_t type = current.op == OP_DUMPI   ? HONEY_TYPE_I64
+                          : current.op == OP_DUMPU ? HONEY_TYPE_U64
+                          : current.op == OP_DUMPF ? HONEY_TYPE_F64
+                                                   : HONEY_TYPE_WORD;
+      honey_dump_word(vm, word, type);
       break;
     }
     case OP_JMP: {
       size_t target = current.operand.as_u64;
-      if (target >= vm->program_size) {
+      if (JUMP_OUT_OF_RANGE(vm, target)) {
         honey_panic(vm, ERR_INST_ILLEGAL_ACCESS, &current);
         return ERR_INST_ILLEGAL_ACCESS;
       }
       
+      EDGE_COUNT(vm, taken);
       vm->ip = target;
+      PREEMPT_CHECK(vm);
       break;
     }
     case OP_JZ: {
@@ -172,12 +653,18 @@ err_code_t honey_interpret(honey_t *vm) {
 
       if (word.as_i64 == 0) {
         size_t target = current.operand.as_u64;
-        if (target >= vm->program_size) {
+        if (JUMP_OUT_OF_RANGE(vm, target)) {
           honey_panic(vm, ERR_INST_ILLEGAL_ACCESS, &current);
           return ERR_INST_ILLEGAL_ACCESS;
         }
 
+        EDGE_COUNT(vm, taken);
+        TRACE_BRANCH(vm, true);
         vm->ip = target;
+        PREEMPT_CHECK(vm);
+      } else {
+        EDGE_COUNT(vm, fallthrough);
+        TRACE_BRANCH(vm, false);
       }
       
       break;
@@ -189,17 +676,408 @@ err_code_t honey_interpret(honey_t *vm) {
 
       if (word.as_i64 != 0) {
         size_t target = current.operand.as_u64;
-        if (target >= vm->program_size) {
+        if (JUMP_OUT_OF_RANGE(vm, target)) {
           honey_panic(vm, ERR_INST_ILLEGAL_ACCESS, &current);
           return ERR_INST_ILLEGAL_ACCESS;
         }
 
+        EDGE_COUNT(vm, taken);
+        TRACE_BRANCH(vm, true);
         vm->ip = target;
+        PREEMPT_CHECK(vm);
+      } else {
+        EDGE_COUNT(vm, fallthrough);
+        TRACE_BRANCH(vm, false);
+      }
+
+      break;
+    }
+    case OP_SPAWN: {
+      SCHED_ASSERT(vm, current);
+      size_t target = current.operand.as_u64;
+      if (target >= vm->program_size) {
+        honey_panic(vm, ERR_INST_ILLEGAL_ACCESS, &current);
+        return ERR_INST_ILLEGAL_ACCESS;
+      }
+
+      word_t arg;
+      bool arg_is_ref = vm->sp > 0 && honey_stack_is_ref(vm, vm->sp - 1);
+      err_code_t res = honey_stack_pop(vm, &arg);
+      PANIC_ASSERT(vm, res, current);
+
+      word_t id;
+      res = sched_spawn(vm->sched, vm, target, arg, arg_is_ref, &id);
+      PANIC_ASSERT(vm, res, current);
+
+      EDGE_COUNT(vm, taken);
+      res = honey_stack_push(vm, id);
+      PANIC_ASSERT(vm, res, current);
+      break;
+    }
+    case OP_YIELD: {
+      SCHED_ASSERT(vm, current);
+      vm->state = HONEY_YIELDED;
+      return ERR_OK;
+    }
+    case OP_JOIN: {
+      SCHED_ASSERT(vm, current);
+      if (vm->sp < 1) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      word_t result;
+      err_code_t res = sched_join(vm->sched, vm, vm->stack[vm->sp - 1], &result);
+      PANIC_ASSERT(vm, res, current);
+      SUSPEND_IF_BLOCKED(vm);
+
+      vm->stack[vm->sp - 1] = result;
+      honey_stack_set_ref(vm, vm->sp - 1, false);
+      break;
+    }
+    case OP_CHAN: {
+      SCHED_ASSERT(vm, current);
+      word_t id;
+      err_code_t res = sched_chan(vm->sched, current.operand.as_u64, &id);
+      PANIC_ASSERT(vm, res, current);
+
+      res = honey_stack_push(vm, id);
+      PANIC_ASSERT(vm, res, current);
+      break;
+    }
+    case OP_SEND: {
+      SCHED_ASSERT(vm, current);
+      if (vm->sp < 2) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      err_code_t res = sched_send(vm->sched, vm, vm->stack[vm->sp - 2],
+                                  vm->stack[vm->sp - 1],
+                                  honey_stack_is_ref(vm, vm->sp - 1));
+      PANIC_ASSERT(vm, res, current);
+      SUSPEND_IF_BLOCKED(vm);
+
+      vm->sp -= 2;
+      break;
+    }
+    case OP_RECV: {
+      SCHED_ASSERT(vm, current);
+      if (vm->sp < 1) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      word_t value;
+      err_code_t res = sched_recv(vm->sched, vm, vm->stack[vm->sp - 1], &value);
+      PANIC_ASSERT(vm, res, current);
+      SUSPEND_IF_BLOCKED(vm);
+
+      vm->stack[vm->sp - 1] = value;
+      honey_stack_set_ref(vm, vm->sp - 1, false);
+      break;
+    }
+    case OP_ALLOC: {
+      if (vm->sp < 1) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      // the length stays on the stack until the object exists, so a
+      // collection triggered by the allocation sees a consistent stack
+      word_t ref;
+      err_code_t res = heap_alloc(vm, OBJ_ARRAY, vm->stack[vm->sp - 1].as_u64, &ref);
+      PANIC_ASSERT(vm, res, current);
+
+      vm->stack[vm->sp - 1] = ref;
+      honey_stack_set_ref(vm, vm->sp - 1, true);
+      break;
+    }
+    case OP_RECORD: {
+      size_t length = current.operand.as_u64;
+      if (length > vm->sp) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      word_t ref;
+      err_code_t res = heap_alloc(vm, OBJ_RECORD, length, &ref);
+      PANIC_ASSERT(vm, res, current);
+
+      // through heap_object_set, so field refs are marked and a record
+      // big enough for the old space still gets its write barrier
+      heap_object_t *object = heap_deref(vm->heap, ref);
+      vm->sp -= length;
+      for (size_t i = 0; i < length; i++)
+        heap_object_set(vm->heap, object, i, vm->stack[vm->sp + i],
+                        honey_stack_is_ref(vm, vm->sp + i));
+
+      res = honey_stack_push_ref(vm, ref, true);
+      PANIC_ASSERT(vm, res, current);
+      break;
+    }
+    case OP_GETF: {
+      word_t ref, index;
+      bool ref_is_ref = vm->sp > 1 && honey_stack_is_ref(vm, vm->sp - 2);
+      err_code_t res_index = honey_stack_pop(vm, &index);
+      err_code_t res_ref = honey_stack_pop(vm, &ref);
+      PANIC_ASSERT(vm, res_index, current);
+      PANIC_ASSERT(vm, res_ref, current);
+
+      // only the ref bit makes a word a reference, an integer that aliases
+      // a live object is still just a number
+      const heap_object_t *object = ref_is_ref ? heap_deref_readable(vm, ref) : NULL;
+      if (!object) {
+        honey_panic(vm, ERR_INVALID_REF, &current);
+        return ERR_INVALID_REF;
+      }
+
+      if (index.as_u64 >= object->length) {
+        honey_panic(vm, ERR_INDEX_OUT_OF_BOUNDS, &current);
+        return ERR_INDEX_OUT_OF_BOUNDS;
+      }
+
+      err_code_t res = honey_stack_push_ref(vm, heap_object_get(object, index.as_u64),
+                                            heap_object_is_ref(object, index.as_u64));
+      PANIC_ASSERT(vm, res, current);
+      break;
+    }
+    case OP_SETF: {
+      word_t ref, index, value;
+      bool value_is_ref = vm->sp > 0 && honey_stack_is_ref(vm, vm->sp - 1);
+      bool ref_is_ref = vm->sp > 2 && honey_stack_is_ref(vm, vm->sp - 3);
+      err_code_t res_value = honey_stack_pop(vm, &value);
+      err_code_t res_index = honey_stack_pop(vm, &index);
+      err_code_t res_ref = honey_stack_pop(vm, &ref);
+      PANIC_ASSERT(vm, res_value, current);
+      PANIC_ASSERT(vm, res_index, current);
+      PANIC_ASSERT(vm, res_ref, current);
+
+      if (!ref_is_ref) {
+        honey_panic(vm, ERR_INVALID_REF, &current);
+        return ERR_INVALID_REF;
+      }
+
+      heap_object_t *object = heap_deref(vm->heap, ref);
+      if (!object && vm->shared_heap && heap_deref(vm->shared_heap, ref)) {
+        honey_panic(vm, ERR_SHARED_REF, &current);
+        return ERR_SHARED_REF;
+      }
+
+      if (!object) {
+        honey_panic(vm, ERR_INVALID_REF, &current);
+        return ERR_INVALID_REF;
+      }
+
+      if (index.as_u64 >= object->length) {
+        honey_panic(vm, ERR_INDEX_OUT_OF_BOUNDS, &current);
+        return ERR_INDEX_OUT_OF_BOUNDS;
+      }
+
+      heap_object_set(vm->heap, object, index.as_u64, value, value_is_ref);
+      break;
+    }
+    case OP_LEN: {
+      word_t ref;
+      bool ref_is_ref = vm->sp > 0 && honey_stack_is_ref(vm, vm->sp - 1);
+      err_code_t res = honey_stack_pop(vm, &ref);
+      PANIC_ASSERT(vm, res, current);
+
+      const heap_object_t *object = ref_is_ref ? heap_deref_readable(vm, ref) : NULL;
+      if (!object) {
+        honey_panic(vm, ERR_INVALID_REF, &current);
+        return ERR_INVALID_REF;
+      }
+
+      res = honey_stack_push(vm, (word_t){.as_u64 = object->length});
+      PANIC_ASSERT(vm, res, current);
+      break;
+    }
+    case OP_CALLNATIVE: {
+      if (current.operand.as_u64 >= vm->native_count) {
+        honey_panic(vm, ERR_INVALID_NATIVE, &current);
+        return ERR_INVALID_NATIVE;
+      }
+
+      const honey_native_t *native = &vm->natives[current.operand.as_u64];
+      if (vm->sp < native->arity) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      if (vm->sp - native->arity + native->results > STACK_MAX) {
+        honey_panic(vm, ERR_STACK_OVERFLOW, &current);
+        return ERR_STACK_OVERFLOW;
+      }
+
+      // a replay takes the recorded results instead of calling the host
+      word_t results[NATIVE_RESULTS_MAX] = {0};
+      if (!trace_replaying(vm->trace)) {
+        err_code_t res = native->fn(vm, &vm->stack[vm->sp - native->arity], results);
+        PANIC_ASSERT(vm, res, current);
+      }
+
+      if (vm->trace)
+        trace_words(vm->trace, results, native->results);
+
+      vm->sp -= native->arity;
+      memcpy(&vm->stack[vm->sp], results, sizeof(word_t) * native->results);
+      for (size_t i = 0; i < native->results; i++)
+        honey_stack_set_ref(vm, vm->sp + i, false);
+      vm->sp += native->results;
+      break;
+    }
+    case OP_BYTES: {
+      if (vm->sp < 1) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      word_t ref;
+      err_code_t res = heap_alloc(vm, OBJ_BYTES, vm->stack[vm->sp - 1].as_u64, &ref);
+      PANIC_ASSERT(vm, res, current);
+
+      vm->stack[vm->sp - 1] = ref;
+      honey_stack_set_ref(vm, vm->sp - 1, true);
+      break;
+    }
+    case OP_OPEN: {
+      if (current.operand.as_u64 >= vm->string_count) {
+        honey_panic(vm, ERR_INVALID_STRING, &current);
+        return ERR_INVALID_STRING;
+      }
+
+      if (vm->sp < 1) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      static const int open_flags[] = {
+          O_RDONLY,
+          O_WRONLY | O_CREAT | O_TRUNC,
+          O_WRONLY | O_CREAT | O_APPEND,
+      };
+
+      uint64_t mode = vm->stack[vm->sp - 1].as_u64;
+      if (mode >= sizeof(open_flags) / sizeof(open_flags[0])) {
+        honey_panic(vm, ERR_INVALID_MODE, &current);
+        return ERR_INVALID_MODE;
+      }
+
+      aio_request_t request = {
+          .op = AIO_OPEN,
+          .path = vm->strings[current.operand.as_u64],
+          .flags = open_flags[mode] | O_CLOEXEC,
+      };
+
+      word_t fd = {0};
+      if (!trace_replaying(vm->trace)) {
+        err_code_t res = honey_io(vm, &request, &fd.as_i64);
+        PANIC_ASSERT(vm, res, current);
+        SUSPEND_IF_BLOCKED(vm);
       }
 
+      if (vm->trace)
+        trace_words(vm->trace, &fd, 1);
+
+      vm->stack[vm->sp - 1] = fd;
+      honey_stack_set_ref(vm, vm->sp - 1, false);
+      break;
+    }
+    case OP_READ:
+    case OP_WRITE: {
+      if (vm->sp < 3) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      // fd, buffer and count stay on the stack until the request completes
+      word_t fd = vm->stack[vm->sp - 3];
+      word_t count = vm->stack[vm->sp - 1];
+      heap_object_t *object = honey_stack_is_ref(vm, vm->sp - 2)
+                                  ? heap_deref(vm->heap, vm->stack[vm->sp - 2])
+                                  : NULL;
+      if (!object || object->kind != OBJ_BYTES) {
+        honey_panic(vm, ERR_INVALID_REF, &current);
+        return ERR_INVALID_REF;
+      }
+
+      if (count.as_u64 > object->length) {
+        honey_panic(vm, ERR_INDEX_OUT_OF_BOUNDS, &current);
+        return ERR_INDEX_OUT_OF_BOUNDS;
+      }
+
+      aio_request_t request = {
+          .op = current.op == OP_READ ? AIO_READ : AIO_WRITE,
+          .fd = (int)fd.as_i64,
+          .buffer = object->fields,
+          .count = count.as_u64,
+      };
+
+      word_t transferred = {0};
+      if (!trace_replaying(vm->trace)) {
+        err_code_t res = honey_io(vm, &request, &transferred.as_i64);
+        PANIC_ASSERT(vm, res, current);
+        SUSPEND_IF_BLOCKED(vm);
+      }
+
+      if (vm->trace) {
+        trace_words(vm->trace, &transferred, 1);
+        if (current.op == OP_READ && transferred.as_i64 > 0 &&
+            transferred.as_u64 <= object->length)
+          trace_bytes(vm->trace, object->fields, transferred.as_u64);
+      }
+
+      vm->sp -= 2;
+      vm->stack[vm->sp - 1] = transferred;
+      honey_stack_set_ref(vm, vm->sp - 1, false);
+      break;
+    }
+    case OP_CLOSE: {
+      if (vm->sp < 1) {
+        honey_panic(vm, ERR_STACK_UNDERFLOW, &current);
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      aio_request_t request = {
+          .op = AIO_CLOSE,
+          .fd = (int)vm->stack[vm->sp - 1].as_i64,
+      };
+
+      if (!trace_replaying(vm->trace)) {
+        int64_t result;
+        err_code_t res = honey_io(vm, &request, &result);
+        PANIC_ASSERT(vm, res, current);
+        SUSPEND_IF_BLOCKED(vm);
+      }
+
+      vm->sp--;
+      break;
+    }
+    case OP_PARFOR: {
+      word_t first, last;
+      err_code_t res_last = honey_stack_pop(vm, &last);
+      err_code_t res_first = honey_stack_pop(vm, &first);
+      PANIC_ASSERT(vm, res_last, current);
+      PANIC_ASSERT(vm, res_first, current);
+
+      // a replay takes the recorded result instead of running the body
+      word_t result = {0};
+      if (!trace_replaying(vm->trace)) {
+        err_code_t res = parfor_run(vm->parfor, vm, current, first.as_i64,
+                                    last.as_i64, &result);
+        PANIC_ASSERT(vm, res, current);
+      }
+
+      if (vm->trace)
+        trace_words(vm->trace, &result, 1);
+
+      err_code_t res = honey_stack_push(vm, result);
+      PANIC_ASSERT(vm, res, current);
       break;
     }
     case OP_HALT:
+      vm->state = HONEY_HALTED;
       return ERR_OK;
     default: {
       fprintf(stderr, "err: Unimplemented instruction has found -> %d\n",
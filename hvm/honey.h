@@ -1,7 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define STACK_MAX 1024
 
@@ -36,6 +38,60 @@ typedef enum inst_op {
   OP_DUP,
   OP_DUMP,
   OP_HALT,
+
+  OP_SPAWN,
+  OP_YIELD,
+  OP_JOIN,
+  OP_CHAN,
+  OP_SEND,
+  OP_RECV,
+
+  OP_ALLOC,
+  OP_RECORD,
+  OP_GETF,
+  OP_SETF,
+  OP_LEN,
+
+  OP_CALLNATIVE,
+
+  OP_BYTES,
+  OP_OPEN,
+  OP_READ,
+  OP_WRITE,
+  OP_CLOSE,
+
+  OP_PLUSU,
+  OP_MINUSU,
+  OP_DIVU,
+  OP_MULTU,
+  OP_MODU,
+  OP_GTU,
+  OP_GTEU,
+  OP_LTU,
+  OP_LTEU,
+
+  OP_PLUSF,
+  OP_MINUSF,
+  OP_DIVF,
+  OP_MULTF,
+  OP_MODF,
+  OP_GTF,
+  OP_GTEF,
+  OP_LTF,
+  OP_LTEF,
+  OP_EQF,
+  OP_NEQF,
+
+  OP_ITOF,
+  OP_FTOI,
+  OP_UTOF,
+  OP_FTOU,
+
+  OP_DUMPI,
+  OP_DUMPU,
+  OP_DUMPF,
+
+  OP_PARFOR,
 } inst_op_t;
 
 typedef struct inst {
@@ -43,32 +99,189 @@ typedef struct inst {
   word_t operand;
 } inst_t;
 
+// parfor's operand packs the body range [start, end) and the reduction
+#define PARFOR_IP_BITS 28
+#define PARFOR_IP_MASK ((1ull << PARFOR_IP_BITS) - 1)
+#define PARFOR_START(operand) ((operand) & PARFOR_IP_MASK)
+#define PARFOR_END(operand) (((operand) >> PARFOR_IP_BITS) & PARFOR_IP_MASK)
+#define PARFOR_REDUCE(operand) ((operand) >> (2 * PARFOR_IP_BITS))
+
+typedef enum parfor_reduce {
+  PARFOR_SUMI,
+  PARFOR_MINI,
+  PARFOR_MAXI,
+  PARFOR_SUMU,
+  PARFOR_MINU,
+  PARFOR_MAXU,
+  PARFOR_SUMF,
+  PARFOR_MINF,
+  PARFOR_MAXF,
+  PARFOR_REDUCE_COUNT,
+} parfor_reduce_t;
+
 typedef enum err_code {
   ERR_OK = 0,
   ERR_STACK_UNDERFLOW,
   ERR_STACK_OVERFLOW,
   ERR_STACK_ILLEGAL_ACCESS,
   ERR_INST_ILLEGAL_ACCESS,
+  ERR_INVALID_REQUEST,
+  ERR_NO_SCHEDULER,
+  ERR_INVALID_HANDLE,
+  ERR_DEADLOCK,
+  ERR_OUT_OF_MEMORY,
+  ERR_INVALID_REF,
+  ERR_INDEX_OUT_OF_BOUNDS,
+  ERR_SHARED_REF,
+  ERR_INVALID_NATIVE,
+  ERR_NATIVE_FAILURE,
+  ERR_INVALID_STRING,
+  ERR_INVALID_MODE,
+  ERR_INVALID_PARFOR,
+  ERR_DIVISION_BY_ZERO,
 } err_code_t;
 
-typedef struct honey {
+typedef enum honey_state {
+  HONEY_RUNNING = 0,
+  HONEY_YIELDED,
+  HONEY_BLOCKED,
+  HONEY_HALTED,
+} honey_state_t;
+
+typedef struct honey_label {
+  char *name;
+  size_t ip;
+} honey_label_t;
+
+typedef struct honey_debug {
+  char *source_path;
+
+  uint32_t *lines;
+  size_t line_count;
+
+  honey_label_t *labels;
+  size_t label_count;
+} honey_debug_t;
+
+typedef struct honey honey_t;
+
+// how a dumped word should be read: `dump` leaves it to the reader, the
+// typed dumps say which view of the word is meant
+typedef enum honey_type {
+  HONEY_TYPE_WORD,
+  HONEY_TYPE_I64,
+  HONEY_TYPE_U64,
+  HONEY_TYPE_F64,
+} honey_type_t;
+
+typedef void (*honey_dump_fn)(honey_t *vm, word_t word, honey_type_t type);
+
+#define NATIVE_RESULTS_MAX 4
+
+// Natives read `arity` arguments (bottom first) and write `results` words;
+// the interpreter replaces the arguments on the stack with the results.
+typedef err_code_t (*honey_native_fn)(honey_t *vm, const word_t *args,
+                                      word_t *results);
+
+typedef struct honey_native {
+  const char *name;
+  uint32_t arity, results;
+  honey_native_fn fn;
+} honey_native_t;
+
+struct sched;
+struct fiber;
+struct heap;
+struct aio;
+struct aio_request;
+struct edge_profile;
+struct trace;
+struct parfor_pool;
+
+struct honey {
   inst_t *program;
   size_t program_size;
+  const honey_debug_t *debug;
 
   word_t stack[STACK_MAX];
   size_t sp, ip;
-} honey_t;
+
+  // One bit per stack slot, set when the slot holds a reference made by the
+  // heap. Only these slots are collector roots, so an integer that happens
+  // to equal an object's address is never moved with it.
+  uint64_t stack_refs[STACK_MAX / 64];
+
+  uint64_t executed_count;
+
+  // Set when running as a fiber: the interpreter returns with `state`
+  // yielded/blocked instead of halting, and taken jumps give the thread
+  // back once executed_count reaches preempt_at.
+  honey_state_t state;
+  uint64_t preempt_at;
+  struct sched *sched;
+  struct fiber *fiber;
+
+  // indexed by callnative, in the program's import order
+  const honey_native_t *natives;
+  size_t native_count;
+
+  // indexed by open, in the program's string table order
+  char *const *strings;
+  size_t string_count;
+
+  // allocated on first use, see heap.h
+  struct heap *heap;
+
+  // Standalone vms wait on their own ring; fibers submit `io` to the
+  // scheduler's ring and block until the completion wakes them.
+  struct aio *aio;
+  struct aio_request *io;
+
+  // branch counters for profile-guided layout, NULL unless --edge-profile
+  struct edge_profile *edges;
+
+  // execution trace being recorded or replayed, see trace.h
+  struct trace *trace;
+
+  // parfor workers, borrowed from whoever set up the vm, see parfor.h
+  struct parfor_pool *parfor;
+
+  // Set on the clones running a parfor body: running off the end of the
+  // body (program_size) finishes an iteration, and objects of the parent's
+  // heap can be read but not written.
+  bool in_parfor;
+  const struct heap *shared_heap;
+
+  honey_dump_fn on_dump;
+  void *userdata;
+};
 
 honey_t *honey_new(inst_t *program, size_t program_size);
 void honey_free(honey_t *vm);
+void honey_reset(honey_t *vm);
 
 err_code_t honey_stack_push(honey_t *vm, word_t value);
+err_code_t honey_stack_push_ref(honey_t *vm, word_t value, bool is_ref);
 err_code_t honey_stack_pop(honey_t *vm, word_t *out);
 
+bool honey_stack_is_ref(const honey_t *vm, size_t index);
+void honey_stack_set_ref(honey_t *vm, size_t index, bool is_ref);
+
 const char *honey_error_cstr(err_code_t code);
 const char *honey_inst_cstr(inst_op_t op);
 
+uint32_t honey_debug_locate(const honey_debug_t *debug, size_t ip,
+                            const honey_label_t **out_label);
+
+// Writes `word` as `type` into `buffer`; floats use the shortest text that
+// reads back to the same value.
+void honey_format_word(char *buffer, size_t size, word_t word, honey_type_t type);
+
+// Hands a dumped word to `on_dump`, or prints it when there is none.
+void honey_dump_word(honey_t *vm, word_t word, honey_type_t type);
+
 void honey_stack_dump(const honey_t *vm);
+void honey_stack_fdump(const honey_t *vm, FILE *out);
 void honey_panic(const honey_t *vm, err_code_t code, const inst_t *current);
 
 err_code_t honey_interpret(honey_t *vm);
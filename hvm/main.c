@@ -1,51 +1,312 @@
 #define SV_IMPL
 #include "../lib/sv.h"
 
+#include "../hasm/hasm.h"
+#include "edge_profile.h"
 #include "honey.h"
+#include "natives.h"
+#include "parfor.h"
+#include "perf.h"
+#include "profiler.h"
+#include "program.h"
+#include "sched.h"
+#include "server.h"
+#include "trace.h"
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-inst_t *load_bytecode_file(const char *filepath, size_t *out_count) {
-  FILE *file = fopen(filepath, "rb");
-  if (!file) {
-    fprintf(stderr, "error -> invalid input filepath.\n");
-    exit(EXIT_FAILURE);
-  }
+void print_usage(void) {
+  printf("Usage: hvm [options] <input>\n");
+  printf("       hvm run [options] <source.hasm>\n");
+  printf("Options:\n");
+  printf("  --no-cache          with run, always assemble instead of reusing the cache\n");
+  printf("  --perf-stat         report process-wide hardware counters around the run\n");
+  printf("  --profile <output>  sample the running ip and write a folded-stack profile\n");
+  printf("  --edge-profile <output>\n");
+  printf("                      count branch edges for `hasm --profile-use`\n");
+  printf("  --trace <output>    record an execution trace (with --serve, one per vm\n");
+  printf("                      at <output>.<n>)\n");
+  printf("  --replay <trace>    re-execute a recorded trace and print the final stack\n");
+  printf("  --at <count>        with --replay, stop after <count> instructions\n");
+  printf("  --serve             load once, then run one request per stdin line\n");
+  printf("  --socket <path>     with --serve, accept requests on a unix socket\n");
+  printf("  --threads <count>   host threads for fibers (default: online cpus)\n");
+}
 
-  fseek(file, 0, SEEK_END);
-  size_t size = ftell(file);
-  rewind(file);
+// the replayed program sees recorded values only, it must not print them again
+static void replay_discard_dump(honey_t *vm, word_t word, honey_type_t type) {
+  (void)vm;
+  (void)word;
+  (void)type;
+}
 
-  *out_count = size / sizeof(inst_t);
-  inst_t *program = malloc(sizeof(inst_t) * *out_count);
-  if (!program) {
-    fprintf(stderr, "error -> cannot alloc memory to program.\n");
-    fclose(file);
-    exit(EXIT_FAILURE);
-  }
+static int replay_trace(const honey_program_t *program, const honey_native_t *natives,
+                        const char *trace_path, uint64_t at) {
+  trace_t *trace = trace_load(trace_path, program->code, program->size);
+  if (!trace)
+    return EXIT_FAILURE;
+  trace->stop_at = at;
+
+  honey_t *hvm = honey_new(program->code, program->size);
+  hvm->debug = program->debug;
+  hvm->natives = natives;
+  hvm->native_count = program->import_count;
+  hvm->strings = program->strings;
+  hvm->string_count = program->string_count;
+  hvm->on_dump = replay_discard_dump;
+  hvm->trace = trace;
+
+  uint64_t run;
+  err_code_t status = trace_replay(trace, hvm, &run);
 
-  fread(program, sizeof(inst_t), *out_count, file);
-  fclose(file);
+  printf("run %lu, %lu instructions", run, trace->count);
+  if (hvm->state == HONEY_HALTED)
+    printf(", halted\n");
+  else if (hvm->ip < hvm->program_size)
+    printf(", next %s at ip %zu\n", honey_inst_cstr(hvm->program[hvm->ip].op), hvm->ip);
+  else
+    printf("\n");
+  honey_stack_fdump(hvm, stdout);
 
-  return program;
+  bool diverged = trace->diverged;
+  if (diverged)
+    fprintf(stderr, "error -> program diverged from the trace at instruction %lu.\n",
+            trace->count);
+
+  honey_free(hvm);
+  trace_unload(trace);
+  return status == ERR_OK && !diverged ? 0 : EXIT_FAILURE;
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
+  char *input_path = NULL;
+  char *profile_path = NULL;
+  char *edge_profile_path = NULL;
+  char *socket_path = NULL;
+  char *trace_path = NULL;
+  char *replay_path = NULL;
+  uint64_t replay_at = UINT64_MAX;
+  bool perf_stat_enabled = false;
+  bool serve_enabled = false;
+  bool run_source = false;
+  bool cache_enabled = true;
+  long thread_count = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (i == 1 && strcmp(argv[i], "run") == 0) {
+      run_source = true;
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      cache_enabled = false;
+    } else if (strcmp(argv[i], "--perf-stat") == 0) {
+      perf_stat_enabled = true;
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "--edge-profile") == 0 && i + 1 < argc) {
+      edge_profile_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--at") == 0 && i + 1 < argc) {
+      replay_at = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      serve_enabled = true;
+    } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      thread_count = atol(argv[++i]);
+    } else if (argv[i][0] == '-' || input_path) {
+      printf("error -> invalid usage.\n");
+      print_usage();
+      return EXIT_FAILURE;
+    } else {
+      input_path = argv[i];
+    }
+  }
+
+  if (!input_path) {
     printf("error -> invalid usage.\n");
-    printf("Usage: hvm <input>\n");
+    print_usage();
+    return EXIT_FAILURE;
+  }
+
+  // the counters wrap a single run, a server has no run to put them around
+  if (serve_enabled && perf_stat_enabled) {
+    fprintf(stderr, "error -> --perf-stat cannot be used with --serve.\n");
+    return EXIT_FAILURE;
+  }
+
+  honey_program_t program;
+  if (run_source) {
+    char *cache_dir = cache_enabled ? hasm_cache_dir() : NULL;
+    bool loaded = hasm_load(input_path, cache_dir, &program);
+    free(cache_dir);
+    if (!loaded) {
+      fprintf(stderr, "error -> cannot assemble %s.\n", input_path);
+      return EXIT_FAILURE;
+    }
+  } else if (!honey_program_load(input_path, &program)) {
+    return EXIT_FAILURE;
+  }
+
+  honey_native_t *natives;
+  if (!natives_bind(&program, NATIVES_BUILTIN, NATIVES_BUILTIN_COUNT, &natives)) {
+    honey_program_free(&program);
+    return EXIT_FAILURE;
+  }
+
+  if (replay_path) {
+    int status = replay_trace(&program, natives, replay_path, replay_at);
+    free(natives);
+    honey_program_free(&program);
+    return status;
+  }
+
+  // one parfor pool for the whole process, lent to every vm
+  bool parfor_enabled = parfor_program_needs(program.code, program.size);
+  parfor_pool_t *parfor = NULL;
+
+  if (serve_enabled) {
+    if (parfor_enabled && !(parfor = parfor_pool_new(0))) {
+      fprintf(stderr, "error -> cannot alloc memory to parfor pool.\n");
+      free(natives);
+      honey_program_free(&program);
+      return EXIT_FAILURE;
+    }
+
+    server_t *server = server_new(&program, natives, parfor);
+    if (!server) {
+      fprintf(stderr, "error -> cannot alloc memory to server.\n");
+      parfor_pool_free(parfor);
+      free(natives);
+      honey_program_free(&program);
+      return EXIT_FAILURE;
+    }
+
+    if (trace_path && !server_trace(server, trace_path)) {
+      server_free(server);
+      parfor_pool_free(parfor);
+      free(natives);
+      honey_program_free(&program);
+      return EXIT_FAILURE;
+    }
+
+    int status = socket_path ? server_run_socket(server, socket_path)
+                             : server_run_stdio(server);
+
+    server_free(server);
+    parfor_pool_free(parfor);
+    free(natives);
+    honey_program_free(&program);
+    return status;
+  }
+
+  honey_t *hvm = honey_new(program.code, program.size);
+  hvm->debug = program.debug;
+  hvm->natives = natives;
+  hvm->native_count = program.import_count;
+  hvm->strings = program.strings;
+  hvm->string_count = program.string_count;
+
+  if (edge_profile_path)
+    hvm->edges = edge_profile_new(program.code, program.size);
+
+  perf_stat_t stat;
+  if (perf_stat_enabled && !perf_stat_open(&stat))
+    fprintf(stderr, "warning -> perf events unavailable, reporting VM counts only.\n");
+
+  // after the perf counters are opened, so they follow its threads
+  if (parfor_enabled && !(hvm->parfor = parfor = parfor_pool_new(0))) {
+    fprintf(stderr, "error -> cannot alloc memory to parfor pool.\n");
+    if (perf_stat_enabled)
+      perf_stat_close(&stat);
+    edge_profile_free(hvm->edges);
+    honey_free(hvm);
+    free(natives);
+    honey_program_free(&program);
     return EXIT_FAILURE;
   }
 
-  char *input_path = argv[1];
-  size_t inst_count;
-  inst_t *program = load_bytecode_file(input_path, &inst_count);
+  bool fibers_enabled = thread_count > 0 || sched_program_needs(program.code, program.size);
+  if (thread_count <= 0)
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (fibers_enabled && profile_path) {
+    fprintf(stderr, "warning -> sampling profiler does not follow fibers, disabled.\n");
+    profile_path = NULL;
+  }
+
+  // the sampler reads the parent's ip, which sits on parfor while the
+  // clones run the body, so every body sample would land on it
+  if (parfor_enabled && profile_path) {
+    fprintf(stderr, "warning -> sampling profiler does not follow parfor bodies, disabled.\n");
+    profile_path = NULL;
+  }
+
+  if (fibers_enabled && trace_path) {
+    fprintf(stderr, "warning -> execution trace does not follow fibers, disabled.\n");
+    trace_path = NULL;
+  }
+
+  if (trace_path) {
+    hvm->trace = trace_open(trace_path, program.code, program.size);
+    if (hvm->trace)
+      trace_reset(hvm->trace, hvm->stack, hvm->sp);
+  }
+
+  profiler_t profiler;
+  if (profile_path && !profiler_start(&profiler, hvm, PROFILER_HZ)) {
+    fprintf(stderr, "warning -> cannot start sampling profiler.\n");
+    profile_path = NULL;
+  }
+
+  if (perf_stat_enabled)
+    perf_stat_start(&stat);
+
+  err_code_t status;
+  if (fibers_enabled) {
+    sched_t *sched = sched_new(thread_count);
+    if (sched) {
+      status = sched_run(sched, hvm);
+      sched_free(sched);
+    } else {
+      fprintf(stderr, "error -> cannot alloc memory to scheduler.\n");
+      status = ERR_OUT_OF_MEMORY;
+    }
+  } else {
+    status = honey_interpret(hvm);
+  }
+
+  if (hvm->trace) {
+    trace_end(hvm->trace, status);
+    trace_close(hvm->trace);
+  }
+
+  if (perf_stat_enabled) {
+    perf_stat_stop(&stat);
+    perf_stat_report(&stat, hvm->executed_count, stderr);
+    perf_stat_close(&stat);
+  }
 
-  honey_t *hvm = honey_new(program, inst_count);
-  honey_interpret(hvm);
+  if (profile_path) {
+    profiler_stop(&profiler);
+    profiler_report(&profiler, stderr);
+    profiler_write_folded(&profiler, profile_path);
+    profiler_free(&profiler);
+  }
+
+  if (hvm->edges) {
+    edge_profile_write(hvm->edges, edge_profile_path);
+    edge_profile_free(hvm->edges);
+  }
 
   honey_free(hvm);
-  free(program);
+  parfor_pool_free(parfor);
+  free(natives);
+  honey_program_free(&program);
 
-  return 0;
+  return status == ERR_OK ? 0 : EXIT_FAILURE;
 }
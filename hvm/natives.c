@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include "natives.h"
+#include "heap.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static err_code_t native_hash(honey_t *vm, const word_t *args, word_t *results) {
+  (void)vm;
+
+  // splitmix64 finalizer
+  uint64_t x = args[0].as_u64 + 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  results[0].as_u64 = x ^ (x >> 31);
+  return ERR_OK;
+}
+
+static err_code_t native_hash_array(honey_t *vm, const word_t *args,
+                                    word_t *results) {
+  const heap_object_t *object = heap_deref_readable(vm, args[0]);
+  if (!object)
+    return ERR_INVALID_REF;
+
+  // FNV-1a over the raw field bytes
+  size_t size = object->kind == OBJ_BYTES ? object->length
+                                          : object->length * sizeof(word_t);
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const uint8_t *bytes = (const uint8_t *)object->fields;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+
+  results[0].as_u64 = hash;
+  return ERR_OK;
+}
+
+static err_code_t native_isqrt(honey_t *vm, const word_t *args, word_t *results) {
+  (void)vm;
+
+  if (args[0].as_i64 < 0)
+    return ERR_NATIVE_FAILURE;
+
+  uint64_t value = args[0].as_u64;
+  uint64_t root = (uint64_t)sqrt((double)value);
+  while (root * root > value)
+    root--;
+  while ((root + 1) * (root + 1) <= value)
+    root++;
+
+  results[0].as_u64 = root;
+  return ERR_OK;
+}
+
+static err_code_t native_abs(honey_t *vm, const word_t *args, word_t *results) {
+  (void)vm;
+  // negated on the unsigned bits, so abs(INT64_MIN) wraps to itself like
+  // divi does instead of overflowing
+  results[0].as_u64 = args[0].as_i64 < 0 ? 0 - args[0].as_u64 : args[0].as_u64;
+  return ERR_OK;
+}
+
+static err_code_t native_clock(honey_t *vm, const word_t *args, word_t *results) {
+  (void)vm;
+  (void)args;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  results[0].as_u64 = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  return ERR_OK;
+}
+
+// goes through the dump path so --serve and other on_dump hosts collect it
+static err_code_t native_print(honey_t *vm, const word_t *args, word_t *results) {
+  (void)results;
+
+  honey_dump_word(vm, args[0], HONEY_TYPE_I64);
+  return ERR_OK;
+}
+
+const honey_native_t NATIVES_BUILTIN[] = {
+    {"hash", 1, 1, native_hash},
+    {"hash_array", 1, 1, native_hash_array},
+    {"isqrt", 1, 1, native_isqrt},
+    {"abs", 1, 1, native_abs},
+    {"clock", 0, 1, native_clock},
+    {"print", 1, 0, native_print},
+};
+
+const size_t NATIVES_BUILTIN_COUNT = sizeof(NATIVES_BUILTIN) / sizeof(honey_native_t);
+
+bool natives_bind(const honey_program_t *program, const honey_native_t *registry,
+                  size_t registry_count, honey_native_t **out_table) {
+  *out_table = NULL;
+  if (program->import_count == 0)
+    return true;
+
+  honey_native_t *table = calloc(program->import_count, sizeof(honey_native_t));
+  for (size_t i = 0; i < program->import_count; i++) {
+    const honey_import_t *import = &program->imports[i];
+
+    const honey_native_t *native = NULL;
+    for (size_t j = 0; j < registry_count && !native; j++) {
+      if (strcmp(registry[j].name, import->name) == 0)
+        native = &registry[j];
+    }
+
+    if (!native) {
+      fprintf(stderr, "error -> unknown native '%s'.\n", import->name);
+      free(table);
+      return false;
+    }
+
+    if (native->arity != import->arity || native->results != import->results ||
+        native->results > NATIVE_RESULTS_MAX) {
+      fprintf(stderr,
+              "error -> native '%s' takes %u and returns %u, imported as %u -> %u.\n",
+              import->name, native->arity, native->results, import->arity,
+              import->results);
+      free(table);
+      return false;
+    }
+
+    table[i] = *native;
+  }
+
+  *out_table = table;
+  return true;
+}
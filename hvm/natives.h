@@ -0,0 +1,16 @@
+#pragma once
+
+#include "honey.h"
+#include "program.h"
+#include <stdbool.h>
+
+// Built-in host functions a program can `import`. Embedders extend the
+// table by passing their own registry to natives_bind.
+extern const honey_native_t NATIVES_BUILTIN[];
+extern const size_t NATIVES_BUILTIN_COUNT;
+
+// Resolves every import of `program` against `registry`, producing a call
+// table in import order (callnative N indexes it). Fails on unknown names or
+// signature mismatches.
+bool natives_bind(const honey_program_t *program, const honey_native_t *registry,
+                  size_t registry_count, honey_native_t **out_table);
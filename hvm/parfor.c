@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include "parfor.h"
+#include "heap.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static word_t parfor_identity(parfor_reduce_t reduce) {
+  switch (reduce) {
+  case PARFOR_MINI:
+    return (word_t){.as_i64 = INT64_MAX};
+  case PARFOR_MAXI:
+    return (word_t){.as_i64 = INT64_MIN};
+  case PARFOR_MINU:
+    return (word_t){.as_u64 = UINT64_MAX};
+  case PARFOR_MINF:
+    return (word_t){.as_f64 = INFINITY};
+  case PARFOR_MAXF:
+    return (word_t){.as_f64 = -INFINITY};
+  case PARFOR_SUMF:
+    return (word_t){.as_f64 = 0.0};
+  default:
+    return (word_t){.as_u64 = 0};
+  }
+}
+
+static word_t parfor_combine(parfor_reduce_t reduce, word_t a, word_t b) {
+  switch (reduce) {
+  case PARFOR_SUMI:
+  case PARFOR_SUMU:
+    // unsigned so an overflowing sum wraps instead of being undefined
+    return (word_t){.as_u64 = a.as_u64 + b.as_u64};
+  case PARFOR_MINI:
+    return b.as_i64 < a.as_i64 ? b : a;
+  case PARFOR_MAXI:
+    return b.as_i64 > a.as_i64 ? b : a;
+  case PARFOR_MINU:
+    return b.as_u64 < a.as_u64 ? b : a;
+  case PARFOR_MAXU:
+    return b.as_u64 > a.as_u64 ? b : a;
+  case PARFOR_SUMF:
+    return (word_t){.as_f64 = a.as_f64 + b.as_f64};
+  case PARFOR_MINF:
+    return (word_t){.as_f64 = fmin(a.as_f64, b.as_f64)};
+  case PARFOR_MAXF:
+    return (word_t){.as_f64 = fmax(a.as_f64, b.as_f64)};
+  default:
+    return a;
+  }
+}
+
+static void parfor_dump(honey_t *clone, word_t word, honey_type_t type) {
+  parfor_pool_t *pool = clone->userdata;
+
+  pthread_mutex_lock(&pool->dump_lock);
+  honey_dump_word(pool->job->parent, word, type);
+  pthread_mutex_unlock(&pool->dump_lock);
+}
+
+static void parfor_fail(parfor_pool_t *pool, parfor_job_t *job, err_code_t status) {
+  pthread_mutex_lock(&pool->lock);
+  if (job->status == ERR_OK)
+    job->status = status;
+  pthread_mutex_unlock(&pool->lock);
+
+  atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+}
+
+static void parfor_drain(parfor_pool_t *pool, parfor_job_t *job, honey_t *clone) {
+  const word_t *seed = job->parent->stack;
+
+  while (!atomic_load_explicit(&job->failed, memory_order_relaxed)) {
+    size_t chunk = atomic_fetch_add_explicit(&job->next_chunk, 1, memory_order_relaxed);
+    if (chunk >= job->chunk_count)
+      return;
+
+    // offsets from `first` are unsigned, a full int64 range still fits
+    uint64_t lo = chunk * job->chunk_size;
+    uint64_t hi = job->count - lo > job->chunk_size ? lo + job->chunk_size : job->count;
+
+    word_t result = parfor_identity(job->reduce);
+    for (uint64_t offset = lo; offset < hi; offset++) {
+      // the body may pop into the seed, so every iteration starts afresh
+      memcpy(clone->stack, seed, sizeof(word_t) * job->seed_sp);
+      memcpy(clone->stack_refs, job->parent->stack_refs, sizeof(clone->stack_refs));
+      clone->stack[job->seed_sp] = (word_t){.as_u64 = (uint64_t)job->first + offset};
+      honey_stack_set_ref(clone, job->seed_sp, false);
+      clone->sp = job->seed_sp + 1;
+      clone->ip = job->body;
+      clone->state = HONEY_RUNNING;
+
+      err_code_t status = honey_interpret(clone);
+      if (status == ERR_OK && clone->sp == 0) {
+        honey_panic(clone, ERR_STACK_UNDERFLOW, NULL);
+        status = ERR_STACK_UNDERFLOW;
+      }
+
+      if (status != ERR_OK) {
+        parfor_fail(pool, job, status);
+        return;
+      }
+
+      result = parfor_combine(job->reduce, result, clone->stack[clone->sp - 1]);
+    }
+
+    job->partials[chunk] = result;
+  }
+}
+
+static void *parfor_worker(void *arg) {
+  honey_t *clone = arg;
+  parfor_pool_t *pool = clone->userdata;
+  uint64_t seen = 0;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping && pool->generation == seen)
+      pthread_cond_wait(&pool->work, &pool->lock);
+
+    if (pool->stopping) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+
+    seen = pool->generation;
+    parfor_job_t *job = pool->job;
+    pthread_mutex_unlock(&pool->lock);
+
+    parfor_drain(pool, job, clone);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->active == 0)
+      pthread_cond_signal(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+parfor_pool_t *parfor_pool_new(size_t thread_count) {
+  if (thread_count == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = online > 1 ? (size_t)online - 1 : 0;
+  }
+
+  parfor_pool_t *pool = calloc(1, sizeof(parfor_pool_t));
+  if (!pool)
+    return NULL;
+
+  pool->clones = calloc(thread_count + 1, sizeof(honey_t *));
+  pool->threads = calloc(thread_count ? thread_count : 1, sizeof(pthread_t));
+  if (!pool->clones || !pool->threads) {
+    free(pool->clones);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->run_lock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pthread_mutex_init(&pool->dump_lock, NULL);
+
+  for (size_t i = 0; i <= thread_count; i++) {
+    // the program and its tables come from the vm running each job
+    honey_t *clone = honey_new(NULL, 0);
+    if (!clone) {
+      parfor_pool_free(pool);
+      return NULL;
+    }
+
+    clone->in_parfor = true;
+    clone->on_dump = parfor_dump;
+    clone->userdata = pool;
+    pool->clones[pool->clone_count++] = clone;
+  }
+
+  for (size_t i = 0; i < thread_count; i++) {
+    if (pthread_create(&pool->threads[i], NULL, parfor_worker, pool->clones[i + 1]) != 0)
+      break;
+    pool->thread_count++;
+  }
+
+  return pool;
+}
+
+void parfor_pool_free(parfor_pool_t *pool) {
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->thread_count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for (size_t i = 0; i < pool->clone_count; i++)
+    honey_free(pool->clones[i]);
+
+  pthread_mutex_destroy(&pool->run_lock);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->dump_lock);
+  free(pool->clones);
+  free(pool->threads);
+  free(pool);
+}
+
+bool parfor_program_needs(const inst_t *program, size_t program_size) {
+  for (size_t i = 0; i < program_size; i++) {
+    if (program[i].op == OP_PARFOR)
+      return true;
+  }
+
+  return false;
+}
+
+err_code_t parfor_run(parfor_pool_t *pool, honey_t *vm, inst_t inst, int64_t first,
+                      int64_t last, word_t *out) {
+  size_t body = PARFOR_START(inst.operand.as_u64);
+  size_t end = PARFOR_END(inst.operand.as_u64);
+  parfor_reduce_t reduce = PARFOR_REDUCE(inst.operand.as_u64);
+
+  if (!pool || vm->in_parfor || body >= end || end > vm->program_size ||
+      reduce >= PARFOR_REDUCE_COUNT)
+    return ERR_INVALID_PARFOR;
+  if (vm->sp >= STACK_MAX)
+    return ERR_STACK_OVERFLOW;
+
+  *out = parfor_identity(reduce);
+  if (first >= last)
+    return ERR_OK;
+
+  // as many chunks as the threads can balance, never empty ones
+  uint64_t count = (uint64_t)last - (uint64_t)first;
+  size_t chunk_count = (pool->thread_count + 1) * PARFOR_CHUNKS_PER_THREAD;
+  if (count < chunk_count)
+    chunk_count = count;
+
+  parfor_job_t job = {
+      .parent = vm,
+      .body = body,
+      .seed_sp = vm->sp,
+      .reduce = reduce,
+      .first = first,
+      .count = count,
+      // rounded up without count + chunk_count overflowing on huge ranges
+      .chunk_size = count / chunk_count + (count % chunk_count != 0),
+      .partials = malloc(sizeof(word_t) * chunk_count),
+      .status = ERR_OK,
+  };
+  if (!job.partials)
+    return ERR_OUT_OF_MEMORY;
+  job.chunk_count = count / job.chunk_size + (count % job.chunk_size != 0);
+  atomic_init(&job.next_chunk, 0);
+  atomic_init(&job.failed, false);
+
+  pthread_mutex_lock(&pool->run_lock);
+
+  // helpers are parked, so their clones can be prepared from here
+  for (size_t i = 0; i <= pool->thread_count; i++) {
+    honey_t *clone = pool->clones[i];
+    clone->program = vm->program;
+    clone->program_size = end;
+    clone->debug = vm->debug;
+    clone->natives = vm->natives;
+    clone->native_count = vm->native_count;
+    clone->strings = vm->strings;
+    clone->string_count = vm->string_count;
+    clone->edges = vm->edges;
+    clone->shared_heap = vm->heap;
+    clone->executed_count = 0;
+    if (clone->heap)
+      heap_reset(clone->heap);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->job = &job;
+  pool->generation++;
+  pool->active = pool->thread_count;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  parfor_drain(pool, &job, pool->clones[0]);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->active > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pool->job = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i <= pool->thread_count; i++)
+    vm->executed_count += pool->clones[i]->executed_count;
+  pthread_mutex_unlock(&pool->run_lock);
+
+  if (job.status == ERR_OK) {
+    for (size_t i = 0; i < job.chunk_count; i++)
+      *out = parfor_combine(reduce, *out, job.partials[i]);
+  }
+
+  free(job.partials);
+  return job.status;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "honey.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// chunks handed out per thread, so uneven iterations still balance
+#define PARFOR_CHUNKS_PER_THREAD 4
+
+// One parfor execution. Chunks are claimed with an atomic counter and each
+// leaves its partial result in `partials`, which are combined in chunk
+// order afterwards so float reductions do not depend on thread timing.
+typedef struct parfor_job {
+  honey_t *parent;
+  size_t body;
+  size_t seed_sp;
+  parfor_reduce_t reduce;
+
+  // indices are first + offset for offsets in [0, count)
+  int64_t first;
+  uint64_t count;
+  uint64_t chunk_size;
+  size_t chunk_count;
+  word_t *partials;
+
+  atomic_size_t next_chunk;
+  atomic_bool failed;
+  err_code_t status;
+} parfor_job_t;
+
+// Helper threads plus one honey_t clone per participating thread; clone 0
+// belongs to the thread that runs the parfor, which works on chunks too.
+// Clones keep their heaps between jobs and are reset at the start of each.
+//
+// One pool serves the whole process: vms only borrow it through
+// honey_t.parfor, and parfors from different fibers or server vms take
+// turns on it instead of each bringing its own threads.
+typedef struct parfor_pool {
+  honey_t **clones;
+  size_t clone_count;
+  pthread_t *threads;
+  size_t thread_count;
+
+  // held for a whole parfor_run, one job at a time
+  pthread_mutex_t run_lock;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  parfor_job_t *job;
+  uint64_t generation;
+  size_t active;
+  bool stopping;
+
+  // serializes dumps from bodies into the parent's output
+  pthread_mutex_t dump_lock;
+} parfor_pool_t;
+
+// `thread_count` helpers, 0 meaning one less than the online cpus.
+parfor_pool_t *parfor_pool_new(size_t thread_count);
+void parfor_pool_free(parfor_pool_t *pool);
+
+bool parfor_program_needs(const inst_t *program, size_t program_size);
+
+// Runs the body `inst` points at once per index in [first, last) and
+// reduces the value each iteration leaves on top of its stack into `out`.
+// Every iteration starts from a copy of the parent's stack with the index
+// pushed on top.
+err_code_t parfor_run(parfor_pool_t *pool, honey_t *vm, inst_t inst, int64_t first,
+                      int64_t last, word_t *out);
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "perf.h"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct perf_counter_info {
+  uint32_t type;
+  uint64_t config;
+};
+
+#define HW_CACHE_MISS(cache)                                                   \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                              \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct perf_counter_info PERF_COUNTERS[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERF_L1I_MISSES] = {PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1I)},
+};
+
+static uint64_t perf_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int perf_event_open(struct perf_event_attr *attr) {
+  return (int)syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+bool perf_stat_open(perf_stat_t *stat) {
+  memset(stat, 0, sizeof(perf_stat_t));
+  bool any = false;
+
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_COUNTERS[i].type;
+    attr.config = PERF_COUNTERS[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // follow the scheduler, parfor and I/O threads created after this
+    attr.inherit = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    stat->fds[i] = perf_event_open(&attr);
+    stat->available[i] = stat->fds[i] >= 0;
+    any |= stat->available[i];
+  }
+
+  return any;
+}
+
+void perf_stat_close(perf_stat_t *stat) {
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (stat->available[i])
+      close(stat->fds[i]);
+  }
+}
+
+void perf_stat_start(perf_stat_t *stat) {
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (!stat->available[i])
+      continue;
+
+    ioctl(stat->fds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(stat->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  stat->start_ns = perf_now_ns();
+}
+
+void perf_stat_stop(perf_stat_t *stat) {
+  stat->elapsed_ns = perf_now_ns() - stat->start_ns;
+
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (!stat->available[i])
+      continue;
+
+    ioctl(stat->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    // value, time_enabled, time_running: scale when the PMU multiplexed us.
+    uint64_t data[3];
+    if (read(stat->fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+      stat->available[i] = false;
+      continue;
+    }
+
+    stat->values[i] = data[2] < data[1]
+                          ? (uint64_t)((double)data[0] * data[1] / data[2])
+                          : data[0];
+  }
+}
+
+const char *perf_counter_cstr(perf_counter_t counter) {
+  switch (counter) {
+  case PERF_CYCLES:
+    return "cycles";
+  case PERF_INSTRUCTIONS:
+    return "instructions";
+  case PERF_BRANCH_MISSES:
+    return "branch-misses";
+  case PERF_L1D_MISSES:
+    return "L1-dcache-load-misses";
+  case PERF_L1I_MISSES:
+    return "L1-icache-load-misses";
+  default:
+    return "unknown";
+  }
+}
+
+void perf_stat_report(const perf_stat_t *stat, uint64_t ops, FILE *out) {
+  fprintf(out, "\nPerformance counter stats (all threads):\n");
+  fprintf(out, "  %16lu  bytecode instructions\n", ops);
+  fprintf(out, "  %16.3f  ms elapsed\n", stat->elapsed_ns / 1e6);
+  if (ops > 0)
+    fprintf(out, "  %16.2f  ns / bytecode op\n", (double)stat->elapsed_ns / ops);
+
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (!stat->available[i]) {
+      fprintf(out, "  %16s  %s\n", "<not supported>", perf_counter_cstr(i));
+      continue;
+    }
+
+    fprintf(out, "  %16lu  %s", stat->values[i], perf_counter_cstr(i));
+    if (ops > 0)
+      fprintf(out, "  (%.2f / bytecode op)", (double)stat->values[i] / ops);
+    fprintf(out, "\n");
+  }
+
+  if (stat->available[PERF_CYCLES] && stat->available[PERF_INSTRUCTIONS] &&
+      stat->values[PERF_CYCLES] > 0)
+    fprintf(out, "  %16.2f  IPC\n",
+            (double)stat->values[PERF_INSTRUCTIONS] / stat->values[PERF_CYCLES]);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum perf_counter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_L1I_MISSES,
+  PERF_COUNTER_COUNT,
+} perf_counter_t;
+
+typedef struct perf_stat {
+  int fds[PERF_COUNTER_COUNT];
+  uint64_t values[PERF_COUNTER_COUNT];
+  bool available[PERF_COUNTER_COUNT];
+
+  uint64_t start_ns, elapsed_ns;
+} perf_stat_t;
+
+// Opens every hardware counter it can; counters the kernel refuses
+// (no PMU, perf_event_paranoid, seccomp...) are just marked unavailable.
+// Returns false only when none of them could be opened.
+//
+// Counters are inherited, so they cover the calling thread and every
+// thread it creates afterwards: open them before starting fibers or
+// parfor workers and the counts are process-wide.
+bool perf_stat_open(perf_stat_t *stat);
+void perf_stat_close(perf_stat_t *stat);
+
+void perf_stat_start(perf_stat_t *stat);
+void perf_stat_stop(perf_stat_t *stat);
+
+const char *perf_counter_cstr(perf_counter_t counter);
+void perf_stat_report(const perf_stat_t *stat, uint64_t bytecode_ops, FILE *out);
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "profiler.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define PROFILER_REPORT_MAX 20
+
+typedef struct {
+  size_t ip;
+  uint64_t count;
+} profiler_entry_t;
+
+static profiler_t *active_profiler = NULL;
+
+static void profiler_handle_signal(int signo) {
+  (void)signo;
+
+  profiler_t *profiler = active_profiler;
+  if (!profiler)
+    return;
+
+  // the interpreter moves ip past an instruction before executing it, so
+  // the one running is ip - 1, like honey_panic reports
+  size_t ip = ((const volatile honey_t *)profiler->vm)->ip;
+  ip = ip > 0 ? ip - 1 : 0;
+  if (ip < profiler->vm->program_size) {
+    profiler->samples[ip]++;
+    profiler->total++;
+  }
+}
+
+static int profiler_entry_compare(const void *a, const void *b) {
+  const profiler_entry_t *x = a, *y = b;
+  if (x->count != y->count)
+    return x->count < y->count ? 1 : -1;
+  return x->ip < y->ip ? -1 : x->ip > y->ip;
+}
+
+bool profiler_start(profiler_t *profiler, const honey_t *vm, int hz) {
+  profiler->vm = vm;
+  profiler->total = 0;
+  profiler->samples = calloc(vm->program_size ? vm->program_size : 1, sizeof(uint64_t));
+  if (!profiler->samples)
+    return false;
+
+  struct sigaction action = {0};
+  action.sa_handler = profiler_handle_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0)
+    return false;
+
+  active_profiler = profiler;
+
+  struct itimerval timer = {0};
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    active_profiler = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void profiler_stop(profiler_t *profiler) {
+  (void)profiler;
+
+  struct itimerval timer = {0};
+  setitimer(ITIMER_PROF, &timer, NULL);
+  active_profiler = NULL;
+}
+
+void profiler_free(profiler_t *profiler) {
+  free(profiler->samples);
+  profiler->samples = NULL;
+}
+
+static void profiler_print_location(const honey_t *vm, size_t ip, FILE *out) {
+  const honey_label_t *label;
+  uint32_t line = honey_debug_locate(vm->debug, ip, &label);
+  if (line == 0)
+    return;
+
+  fprintf(out, "  %s:%u", vm->debug->source_path, line);
+  if (label)
+    fprintf(out, " (%s+%zu)", label->name, ip - label->ip);
+}
+
+void profiler_report(const profiler_t *profiler, FILE *out) {
+  const honey_t *vm = profiler->vm;
+
+  fprintf(out, "\nSampling profile (%lu samples @ %d Hz):\n", profiler->total,
+          PROFILER_HZ);
+  if (profiler->total == 0) {
+    fprintf(out, "  [ no samples, run was too short ]\n");
+    return;
+  }
+
+  profiler_entry_t *entries = malloc(sizeof(profiler_entry_t) * vm->program_size);
+  size_t entry_count = 0;
+  for (size_t ip = 0; ip < vm->program_size; ip++) {
+    if (profiler->samples[ip] > 0)
+      entries[entry_count++] = (profiler_entry_t){.ip = ip, .count = profiler->samples[ip]};
+  }
+
+  qsort(entries, entry_count, sizeof(profiler_entry_t), profiler_entry_compare);
+
+  for (size_t i = 0; i < entry_count && i < PROFILER_REPORT_MAX; i++) {
+    profiler_entry_t entry = entries[i];
+    fprintf(out, "  %6.2f%%  %8lu  IP=%-6zu %-8s", 100.0 * entry.count / profiler->total,
+            entry.count, entry.ip, honey_inst_cstr(vm->program[entry.ip].op));
+    profiler_print_location(vm, entry.ip, out);
+    fprintf(out, "\n");
+  }
+
+  free(entries);
+}
+
+bool profiler_write_folded(const profiler_t *profiler, const char *filepath) {
+  FILE *output = fopen(filepath, "w");
+  if (!output) {
+    fprintf(stderr, "error -> cannot open profile output file.\n");
+    return false;
+  }
+
+  const honey_t *vm = profiler->vm;
+  for (size_t ip = 0; ip < vm->program_size; ip++) {
+    if (profiler->samples[ip] == 0)
+      continue;
+
+    const char *op = honey_inst_cstr(vm->program[ip].op);
+    const honey_label_t *label;
+    uint32_t line = honey_debug_locate(vm->debug, ip, &label);
+
+    if (line == 0) {
+      fprintf(output, "IP=%zu %s %lu\n", ip, op, profiler->samples[ip]);
+      continue;
+    }
+
+    fprintf(output, "%s;%s;%s:%u %s %lu\n", vm->debug->source_path,
+            label ? label->name : "<start>", vm->debug->source_path, line, op,
+            profiler->samples[ip]);
+  }
+
+  fclose(output);
+  return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "honey.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROFILER_HZ 1000
+
+// Statistical profiler: a SIGPROF timer samples the ip of the running vm,
+// so the interpreter loop itself stays untouched.
+typedef struct profiler {
+  const honey_t *vm;
+
+  uint64_t *samples;
+  uint64_t total;
+} profiler_t;
+
+bool profiler_start(profiler_t *profiler, const honey_t *vm, int hz);
+void profiler_stop(profiler_t *profiler);
+void profiler_free(profiler_t *profiler);
+
+void profiler_report(const profiler_t *profiler, FILE *out);
+bool profiler_write_folded(const profiler_t *profiler, const char *filepath);
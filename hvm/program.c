@@ -0,0 +1,359 @@
+#include "program.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint8_t *data;
+  size_t size, cap;
+} bytes_t;
+
+typedef struct {
+  const uint8_t *data;
+  size_t size, cursor;
+} reader_t;
+
+static void bytes_push(bytes_t *bytes, const void *data, size_t size) {
+  if (bytes->size + size > bytes->cap) {
+    while (bytes->size + size > bytes->cap)
+      bytes->cap = bytes->cap ? bytes->cap * 2 : 256;
+    bytes->data = realloc(bytes->data, bytes->cap);
+  }
+
+  memcpy(bytes->data + bytes->size, data, size);
+  bytes->size += size;
+}
+
+static void bytes_push_u32(bytes_t *bytes, uint32_t value) {
+  bytes_push(bytes, &value, sizeof(value));
+}
+
+static void bytes_push_u64(bytes_t *bytes, uint64_t value) {
+  bytes_push(bytes, &value, sizeof(value));
+}
+
+static void bytes_push_str(bytes_t *bytes, const char *str) {
+  uint32_t length = str ? (uint32_t)strlen(str) : 0;
+  bytes_push_u32(bytes, length);
+  bytes_push(bytes, str, length);
+}
+
+static bool reader_read(reader_t *reader, void *out, size_t size) {
+  if (reader->size - reader->cursor < size)
+    return false;
+
+  memcpy(out, reader->data + reader->cursor, size);
+  reader->cursor += size;
+  return true;
+}
+
+static bool reader_read_str(reader_t *reader, char **out) {
+  uint32_t length;
+  if (!reader_read(reader, &length, sizeof(length)) ||
+      reader->size - reader->cursor < length)
+    return false;
+
+  *out = malloc(length + 1);
+  memcpy(*out, reader->data + reader->cursor, length);
+  (*out)[length] = '\0';
+  reader->cursor += length;
+  return true;
+}
+
+static void program_encode_debug(bytes_t *bytes, const honey_debug_t *debug) {
+  bytes_push_str(bytes, debug->source_path);
+
+  bytes_push_u64(bytes, debug->line_count);
+  bytes_push(bytes, debug->lines, sizeof(uint32_t) * debug->line_count);
+
+  bytes_push_u64(bytes, debug->label_count);
+  for (size_t i = 0; i < debug->label_count; i++) {
+    bytes_push_u64(bytes, debug->labels[i].ip);
+    bytes_push_str(bytes, debug->labels[i].name);
+  }
+}
+
+static honey_debug_t *program_decode_debug(reader_t *reader) {
+  honey_debug_t *debug = calloc(1, sizeof(honey_debug_t));
+  uint64_t count;
+
+  if (!reader_read_str(reader, &debug->source_path) ||
+      !reader_read(reader, &count, sizeof(count)) ||
+      count > reader->size / sizeof(uint32_t))
+    goto fail;
+
+  debug->line_count = count;
+  debug->lines = malloc(sizeof(uint32_t) * (count ? count : 1));
+  if (!reader_read(reader, debug->lines, sizeof(uint32_t) * count) ||
+      !reader_read(reader, &count, sizeof(count)) || count > reader->size)
+    goto fail;
+
+  debug->labels = calloc(count ? count : 1, sizeof(honey_label_t));
+  for (size_t i = 0; i < count; i++) {
+    uint64_t ip;
+    if (!reader_read(reader, &ip, sizeof(ip)) ||
+        !reader_read_str(reader, &debug->labels[i].name))
+      goto fail;
+
+    debug->labels[i].ip = ip;
+    debug->label_count++;
+  }
+
+  return debug;
+
+fail:
+  honey_debug_free(debug);
+  return NULL;
+}
+
+static void program_encode_imports(bytes_t *bytes, const honey_program_t *program) {
+  bytes_push_u64(bytes, program->import_count);
+  for (size_t i = 0; i < program->import_count; i++) {
+    bytes_push_str(bytes, program->imports[i].name);
+    bytes_push_u32(bytes, program->imports[i].arity);
+    bytes_push_u32(bytes, program->imports[i].results);
+  }
+}
+
+static bool program_decode_imports(reader_t *reader, honey_program_t *out) {
+  uint64_t count;
+  if (!reader_read(reader, &count, sizeof(count)) || count > reader->size)
+    return false;
+
+  out->imports = calloc(count ? count : 1, sizeof(honey_import_t));
+  for (size_t i = 0; i < count; i++) {
+    honey_import_t *import = &out->imports[i];
+    if (!reader_read_str(reader, &import->name) ||
+        !reader_read(reader, &import->arity, sizeof(import->arity)) ||
+        !reader_read(reader, &import->results, sizeof(import->results)))
+      return false;
+
+    out->import_count++;
+  }
+
+  return true;
+}
+
+static void program_encode_strings(bytes_t *bytes, const honey_program_t *program) {
+  bytes_push_u64(bytes, program->string_count);
+  for (size_t i = 0; i < program->string_count; i++)
+    bytes_push_str(bytes, program->strings[i]);
+}
+
+static bool program_decode_strings(reader_t *reader, honey_program_t *out) {
+  uint64_t count;
+  if (!reader_read(reader, &count, sizeof(count)) || count > reader->size)
+    return false;
+
+  out->strings = calloc(count ? count : 1, sizeof(char *));
+  for (size_t i = 0; i < count; i++) {
+    if (!reader_read_str(reader, &out->strings[i]))
+      return false;
+
+    out->string_count++;
+  }
+
+  return true;
+}
+
+static void program_encode_section(bytes_t *bytes, program_section_t kind,
+                                   const bytes_t *payload) {
+  bytes_push_u32(bytes, kind);
+  bytes_push_u32(bytes, 0);
+  bytes_push_u64(bytes, payload->size);
+  bytes_push(bytes, payload->data, payload->size);
+}
+
+bool honey_program_load(const char *filepath, honey_program_t *out) {
+  memset(out, 0, sizeof(honey_program_t));
+
+  FILE *file = fopen(filepath, "rb");
+  if (!file) {
+    fprintf(stderr, "error -> invalid input filepath.\n");
+    return false;
+  }
+
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+
+  uint8_t *buffer = malloc(size ? size : 1);
+  if (!buffer) {
+    fprintf(stderr, "error -> cannot alloc memory to program.\n");
+    fclose(file);
+    return false;
+  }
+
+  size_t read_count = fread(buffer, 1, size, file);
+  fclose(file);
+  if (read_count != size) {
+    fprintf(stderr, "error -> unexpected error during input file reading.\n");
+    free(buffer);
+    return false;
+  }
+
+  size_t code_size = size;
+  uint64_t sections_size = 0;
+  const size_t footer_size = sizeof(uint64_t) + sizeof(PROGRAM_MAGIC);
+
+  if (size >= footer_size &&
+      memcmp(buffer + size - sizeof(PROGRAM_MAGIC), PROGRAM_MAGIC,
+             sizeof(PROGRAM_MAGIC)) == 0) {
+    memcpy(&sections_size, buffer + size - footer_size, sizeof(uint64_t));
+    if (sections_size > size - footer_size) {
+      fprintf(stderr, "error -> malformed bytecode sections.\n");
+      free(buffer);
+      return false;
+    }
+
+    code_size = size - footer_size - sections_size;
+  }
+
+  out->size = code_size / sizeof(inst_t);
+  out->code = malloc(sizeof(inst_t) * (out->size ? out->size : 1));
+  memcpy(out->code, buffer, sizeof(inst_t) * out->size);
+
+  reader_t reader = {.data = buffer + code_size, .size = sections_size};
+  while (reader.cursor < reader.size) {
+    uint32_t kind, reserved;
+    uint64_t payload_size;
+    if (!reader_read(&reader, &kind, sizeof(kind)) ||
+        !reader_read(&reader, &reserved, sizeof(reserved)) ||
+        !reader_read(&reader, &payload_size, sizeof(payload_size)) ||
+        payload_size > reader.size - reader.cursor) {
+      fprintf(stderr, "error -> malformed bytecode sections.\n");
+      honey_program_free(out);
+      free(buffer);
+      return false;
+    }
+
+    reader_t payload = {.data = reader.data + reader.cursor,
+                        .size = payload_size};
+    reader.cursor += payload_size;
+
+    switch (kind) {
+    case SECTION_DEBUG:
+      out->debug = program_decode_debug(&payload);
+      if (!out->debug)
+        fprintf(stderr, "warning -> ignoring malformed debug section.\n");
+      break;
+    case SECTION_IMPORTS:
+      if (!program_decode_imports(&payload, out)) {
+        fprintf(stderr, "error -> malformed imports section.\n");
+        honey_program_free(out);
+        free(buffer);
+        return false;
+      }
+      break;
+    case SECTION_STRINGS:
+      if (!program_decode_strings(&payload, out)) {
+        fprintf(stderr, "error -> malformed strings section.\n");
+        honey_program_free(out);
+        free(buffer);
+        return false;
+      }
+      break;
+    default:
+      // unknown sections are skipped so older VMs can run newer files
+      break;
+    }
+  }
+
+  free(buffer);
+  return true;
+}
+
+bool honey_program_write(const char *filepath, const honey_program_t *program) {
+  FILE *output = fopen(filepath, "wb");
+  if (!output) {
+    fprintf(stderr, "error -> cannot open output file.\n");
+    return false;
+  }
+
+  bytes_t sections = {0};
+  if (program->debug) {
+    bytes_t payload = {0};
+    program_encode_debug(&payload, program->debug);
+    program_encode_section(&sections, SECTION_DEBUG, &payload);
+    free(payload.data);
+  }
+
+  if (program->import_count > 0) {
+    bytes_t payload = {0};
+    program_encode_imports(&payload, program);
+    program_encode_section(&sections, SECTION_IMPORTS, &payload);
+    free(payload.data);
+  }
+
+  if (program->string_count > 0) {
+    bytes_t payload = {0};
+    program_encode_strings(&payload, program);
+    program_encode_section(&sections, SECTION_STRINGS, &payload);
+    free(payload.data);
+  }
+
+  if (sections.size > 0) {
+    bytes_push_u64(&sections, sections.size);
+    bytes_push(&sections, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC));
+  }
+
+  size_t write_count = fwrite(program->code, sizeof(inst_t), program->size, output);
+  bool ok = write_count == program->size &&
+            fwrite(sections.data, 1, sections.size, output) == sections.size;
+  free(sections.data);
+
+  if (fclose(output) != 0 || !ok) {
+    fprintf(stderr, "error -> unexpected error during output file writing.\n");
+    return false;
+  }
+
+  return true;
+}
+
+void honey_debug_free(honey_debug_t *debug) {
+  if (!debug)
+    return;
+
+  for (size_t i = 0; i < debug->label_count; i++)
+    free(debug->labels[i].name);
+
+  free(debug->labels);
+  free(debug->lines);
+  free(debug->source_path);
+  free(debug);
+}
+
+void honey_program_free(honey_program_t *program) {
+  honey_debug_free(program->debug);
+  free(program->code);
+
+  for (size_t i = 0; i < program->import_count; i++)
+    free(program->imports[i].name);
+  free(program->imports);
+
+  for (size_t i = 0; i < program->string_count; i++)
+    free(program->strings[i]);
+  free(program->strings);
+
+  program->imports = NULL;
+  program->import_count = 0;
+  program->strings = NULL;
+  program->string_count = 0;
+  program->debug = NULL;
+  program->code = NULL;
+  program->size = 0;
+}
+
+uint64_t honey_program_checksum(const inst_t *code, size_t size) {
+  // FNV-1a over op and operand, inst_t padding is not stable across builds
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; i++) {
+    uint64_t fields[2] = {(uint64_t)code[i].op, code[i].operand.as_u64};
+    const uint8_t *bytes = (const uint8_t *)fields;
+    for (size_t j = 0; j < sizeof(fields); j++)
+      hash = (hash ^ bytes[j]) * 0x100000001b3ull;
+  }
+
+  return hash;
+}
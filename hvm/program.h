@@ -0,0 +1,50 @@
+#pragma once
+
+#include "honey.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// .hbc layout: the raw inst_t array, optionally followed by sections and a
+// footer. Files without the footer are plain instruction arrays, so old
+// bytecode keeps loading.
+//
+//   inst_t code[]
+//   { uint32_t kind; uint32_t reserved; uint64_t size; uint8_t payload[size]; }*
+//   { uint64_t sections_size; char magic[8]; }
+#define PROGRAM_MAGIC "HNYSECT"
+
+typedef enum program_section {
+  SECTION_DEBUG = 1,
+  SECTION_IMPORTS,
+  SECTION_STRINGS,
+} program_section_t;
+
+typedef struct honey_import {
+  char *name;
+  uint32_t arity, results;
+} honey_import_t;
+
+typedef struct honey_program {
+  inst_t *code;
+  size_t size;
+
+  honey_debug_t *debug;
+
+  honey_import_t *imports;
+  size_t import_count;
+
+  // constants referenced by index, e.g. the path operand of `open`
+  char **strings;
+  size_t string_count;
+} honey_program_t;
+
+bool honey_program_load(const char *filepath, honey_program_t *out);
+bool honey_program_write(const char *filepath, const honey_program_t *program);
+void honey_program_free(honey_program_t *program);
+
+// identifies an instruction stream, e.g. the one a profile or trace was
+// recorded against
+uint64_t honey_program_checksum(const inst_t *code, size_t size);
+
+void honey_debug_free(honey_debug_t *debug);
@@ -0,0 +1,534 @@
+#include "sched.h"
+#include "heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static _Thread_local worker_t *current_worker = NULL;
+
+static void run_queue_init(run_queue_t *queue) {
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->cap = SCHED_QUEUE_INIT;
+  queue->items = calloc(queue->cap, sizeof(fiber_t *));
+  queue->head = 0;
+  queue->count = 0;
+}
+
+static void run_queue_free(run_queue_t *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->items);
+}
+
+static void run_queue_push(run_queue_t *queue, fiber_t *fiber) {
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->count >= queue->cap) {
+    fiber_t **items = calloc(queue->cap * 2, sizeof(fiber_t *));
+    for (size_t i = 0; i < queue->count; i++)
+      items[i] = queue->items[(queue->head + i) % queue->cap];
+
+    free(queue->items);
+    queue->items = items;
+    queue->head = 0;
+    queue->cap *= 2;
+  }
+
+  queue->items[(queue->head + queue->count++) % queue->cap] = fiber;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// The owner takes from the front so yielded fibers go behind the others,
+// thieves take from the back to stay away from the owner's end.
+static fiber_t *run_queue_pop(run_queue_t *queue, bool steal) {
+  pthread_mutex_lock(&queue->lock);
+
+  fiber_t *fiber = NULL;
+  if (queue->count > 0) {
+    if (steal) {
+      fiber = queue->items[(queue->head + queue->count - 1) % queue->cap];
+    } else {
+      fiber = queue->items[queue->head];
+      queue->head = (queue->head + 1) % queue->cap;
+    }
+    queue->count--;
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  return fiber;
+}
+
+static bool run_queue_empty(run_queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  bool empty = queue->count == 0;
+  pthread_mutex_unlock(&queue->lock);
+  return empty;
+}
+
+// caller holds sched->lock
+static void sched_enqueue(sched_t *sched, fiber_t *fiber) {
+  worker_t *worker = current_worker ? current_worker : &sched->workers[0];
+  run_queue_push(&worker->queue, fiber);
+
+  atomic_fetch_add(&sched->queued, 1);
+  pthread_cond_signal(&sched->idle);
+}
+
+// caller holds sched->lock
+static void sched_wake(sched_t *sched, fiber_t *fiber) {
+  if (fiber->parked) {
+    fiber->parked = false;
+    sched_enqueue(sched, fiber);
+  } else {
+    fiber->woken = true;
+  }
+}
+
+// caller holds sched->lock
+static void sched_block(honey_t *vm, fiber_t **waiters) {
+  fiber_t *fiber = vm->fiber;
+  fiber->parked = false;
+  fiber->woken = false;
+  fiber->next_waiter = *waiters;
+  *waiters = fiber;
+
+  vm->state = HONEY_BLOCKED;
+}
+
+// caller holds sched->lock
+static void sched_wake_one(sched_t *sched, fiber_t **waiters) {
+  fiber_t *fiber = *waiters;
+  if (!fiber)
+    return;
+
+  *waiters = fiber->next_waiter;
+  fiber->next_waiter = NULL;
+  sched_wake(sched, fiber);
+}
+
+// caller holds sched->lock
+static void sched_finish(sched_t *sched, err_code_t status) {
+  if (!sched->finished) {
+    sched->finished = true;
+    sched->status = status;
+  }
+
+  if (sched->io_waiting)
+    aio_interrupt(sched->aio);
+
+  pthread_cond_broadcast(&sched->idle);
+}
+
+static size_t sched_io_pending(const sched_t *sched) {
+  return sched->aio ? sched->aio->pending : 0;
+}
+
+// caller holds sched->lock
+static void sched_reap_io(sched_t *sched) {
+  if (!sched->aio)
+    return;
+
+  aio_request_t *request = aio_poll(sched->aio, false);
+  while (request) {
+    aio_request_t *next = request->next;
+    sched_wake(sched, request->owner);
+    sched_wake_one(sched, &sched->io_full_waiters);
+    request = next;
+  }
+}
+
+// caller holds sched->lock, which is released while waiting
+static void sched_wait_io(sched_t *sched) {
+  aio_flush(sched->aio);
+  sched->io_waiting = true;
+  pthread_mutex_unlock(&sched->lock);
+
+  aio_wait(sched->aio);
+
+  pthread_mutex_lock(&sched->lock);
+  sched->io_waiting = false;
+  sched_reap_io(sched);
+}
+
+static fiber_t *worker_next(worker_t *worker) {
+  sched_t *sched = worker->sched;
+
+  // count ourselves as running before the fiber leaves its queue, so an
+  // idle worker never sees "nothing queued, nothing running" mid-transfer
+  atomic_fetch_add(&sched->running, 1);
+
+  fiber_t *fiber = run_queue_pop(&worker->queue, false);
+  for (size_t i = 1; !fiber && i < sched->worker_count; i++) {
+    worker_t *victim = &sched->workers[(worker->index + i) % sched->worker_count];
+    fiber = run_queue_pop(&victim->queue, true);
+  }
+
+  if (fiber)
+    atomic_fetch_sub(&sched->queued, 1);
+  else
+    atomic_fetch_sub(&sched->running, 1);
+
+  return fiber;
+}
+
+static void worker_after_run(sched_t *sched, fiber_t *fiber, err_code_t res) {
+  honey_t *vm = fiber->vm;
+
+  if (res != ERR_OK) {
+    sched_finish(sched, res);
+    return;
+  }
+
+  switch (vm->state) {
+  case HONEY_YIELDED:
+    sched_enqueue(sched, fiber);
+    break;
+  case HONEY_BLOCKED:
+    if (fiber->woken) {
+      fiber->woken = false;
+      sched_enqueue(sched, fiber);
+    } else {
+      fiber->parked = true;
+    }
+    break;
+  case HONEY_HALTED:
+  default:
+    fiber->done = true;
+    fiber->result = vm->sp > 0 ? vm->stack[vm->sp - 1] : (word_t){0};
+    while (fiber->joiners)
+      sched_wake_one(sched, &fiber->joiners);
+
+    if (vm == sched->root) {
+      sched_finish(sched, ERR_OK);
+    } else {
+      honey_free(vm);
+      fiber->vm = NULL;
+    }
+    break;
+  }
+}
+
+static void *worker_main(void *arg) {
+  worker_t *worker = arg;
+  sched_t *sched = worker->sched;
+  current_worker = worker;
+
+  while (1) {
+    fiber_t *fiber = worker_next(worker);
+
+    if (!fiber) {
+      pthread_mutex_lock(&sched->lock);
+      while (!sched->finished && atomic_load(&sched->queued) == 0) {
+        if (sched_io_pending(sched) > 0 && !sched->io_waiting) {
+          sched_wait_io(sched);
+          continue;
+        }
+
+        if (atomic_load(&sched->running) == 0 && sched_io_pending(sched) == 0) {
+          sched_finish(sched, ERR_DEADLOCK);
+          break;
+        }
+
+        pthread_cond_wait(&sched->idle, &sched->lock);
+      }
+
+      bool finished = sched->finished;
+      pthread_mutex_unlock(&sched->lock);
+
+      if (finished)
+        return NULL;
+      continue;
+    }
+
+    honey_t *vm = fiber->vm;
+    uint64_t before = vm->executed_count;
+    vm->state = HONEY_RUNNING;
+    vm->preempt_at = before + SCHED_QUANTUM;
+
+    err_code_t res = honey_interpret(vm);
+    atomic_fetch_add(&sched->executed_count, vm->executed_count - before);
+
+    pthread_mutex_lock(&sched->lock);
+    worker_after_run(sched, fiber, res);
+
+    // submissions are batched until this worker runs out of fibers;
+    // completions are collected after every run
+    if (sched->aio) {
+      if (run_queue_empty(&worker->queue))
+        aio_flush(sched->aio);
+      sched_reap_io(sched);
+    }
+
+    if (atomic_fetch_sub(&sched->running, 1) == 1)
+      pthread_cond_broadcast(&sched->idle);
+
+    bool finished = sched->finished;
+    pthread_mutex_unlock(&sched->lock);
+
+    if (finished)
+      return NULL;
+  }
+}
+
+sched_t *sched_new(size_t worker_count) {
+  sched_t *sched = calloc(1, sizeof(sched_t));
+  if (!sched)
+    return NULL;
+
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->idle, NULL);
+
+  atomic_init(&sched->queued, 0);
+  atomic_init(&sched->running, 0);
+  atomic_init(&sched->executed_count, 0);
+
+  worker_count = worker_count ? worker_count : 1;
+  sched->workers = calloc(worker_count, sizeof(worker_t));
+  sched->fiber_cap = 64;
+  sched->fibers = calloc(sched->fiber_cap, sizeof(fiber_t *));
+  sched->channel_cap = 16;
+  sched->channels = calloc(sched->channel_cap, sizeof(channel_t *));
+
+  // worker_count stays 0 until the workers exist, so sched_free skips them
+  if (!sched->workers || !sched->fibers || !sched->channels) {
+    sched_free(sched);
+    return NULL;
+  }
+
+  sched->worker_count = worker_count;
+  for (size_t i = 0; i < sched->worker_count; i++) {
+    sched->workers[i].sched = sched;
+    sched->workers[i].index = i;
+    run_queue_init(&sched->workers[i].queue);
+  }
+
+  return sched;
+}
+
+void sched_free(sched_t *sched) {
+  // in-flight requests point into fiber memory, stop them first
+  aio_free(sched->aio);
+
+  for (size_t i = 0; i < sched->fiber_count; i++) {
+    fiber_t *fiber = sched->fibers[i];
+    if (fiber->vm && fiber->vm != sched->root)
+      honey_free(fiber->vm);
+    free(fiber);
+  }
+
+  for (size_t i = 0; i < sched->channel_count; i++) {
+    free(sched->channels[i]->buffer);
+    free(sched->channels[i]);
+  }
+
+  for (size_t i = 0; i < sched->worker_count; i++)
+    run_queue_free(&sched->workers[i].queue);
+
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->idle);
+  free(sched->workers);
+  free(sched->fibers);
+  free(sched->channels);
+  free(sched);
+}
+
+// caller holds sched->lock
+static fiber_t *sched_register_fiber(sched_t *sched, honey_t *vm) {
+  if (sched->fiber_count >= sched->fiber_cap) {
+    sched->fiber_cap *= 2;
+    sched->fibers = realloc(sched->fibers, sizeof(fiber_t *) * sched->fiber_cap);
+  }
+
+  fiber_t *fiber = calloc(1, sizeof(fiber_t));
+  fiber->vm = vm;
+  fiber->id = sched->fiber_count;
+  sched->fibers[sched->fiber_count++] = fiber;
+
+  vm->sched = sched;
+  vm->fiber = fiber;
+  return fiber;
+}
+
+err_code_t sched_run(sched_t *sched, honey_t *root) {
+  sched->root = root;
+
+  pthread_mutex_lock(&sched->lock);
+  sched_enqueue(sched, sched_register_fiber(sched, root));
+  pthread_mutex_unlock(&sched->lock);
+
+  for (size_t i = 0; i < sched->worker_count; i++)
+    pthread_create(&sched->workers[i].thread, NULL, worker_main, &sched->workers[i]);
+
+  for (size_t i = 0; i < sched->worker_count; i++)
+    pthread_join(sched->workers[i].thread, NULL);
+
+  root->executed_count = atomic_load(&sched->executed_count);
+  if (sched->status == ERR_DEADLOCK)
+    honey_panic(root, ERR_DEADLOCK, NULL);
+
+  return sched->status;
+}
+
+bool sched_program_needs(const inst_t *program, size_t program_size) {
+  for (size_t i = 0; i < program_size; i++) {
+    if (program[i].op >= OP_SPAWN && program[i].op <= OP_RECV)
+      return true;
+  }
+
+  return false;
+}
+
+err_code_t sched_spawn(sched_t *sched, honey_t *vm, size_t target, word_t arg,
+                       bool arg_is_ref, word_t *out_id) {
+  // every fiber collects its own heap, references cannot leave it
+  if (arg_is_ref)
+    return ERR_SHARED_REF;
+
+  honey_t *child = honey_new(vm->program, vm->program_size);
+  if (!child)
+    return ERR_OUT_OF_MEMORY;
+
+  child->debug = vm->debug;
+  child->natives = vm->natives;
+  child->native_count = vm->native_count;
+  child->strings = vm->strings;
+  child->string_count = vm->string_count;
+  child->edges = vm->edges;
+  child->parfor = vm->parfor;
+  child->on_dump = vm->on_dump;
+  child->userdata = vm->userdata;
+  child->ip = target;
+  honey_stack_push(child, arg);
+
+  pthread_mutex_lock(&sched->lock);
+  fiber_t *fiber = sched_register_fiber(sched, child);
+  sched_enqueue(sched, fiber);
+  pthread_mutex_unlock(&sched->lock);
+
+  *out_id = (word_t){.as_u64 = fiber->id};
+  return ERR_OK;
+}
+
+err_code_t sched_join(sched_t *sched, honey_t *vm, word_t id, word_t *out) {
+  pthread_mutex_lock(&sched->lock);
+
+  if (id.as_u64 >= sched->fiber_count || sched->fibers[id.as_u64] == vm->fiber) {
+    pthread_mutex_unlock(&sched->lock);
+    return ERR_INVALID_HANDLE;
+  }
+
+  fiber_t *target = sched->fibers[id.as_u64];
+  if (target->done)
+    *out = target->result;
+  else
+    sched_block(vm, &target->joiners);
+
+  pthread_mutex_unlock(&sched->lock);
+  return ERR_OK;
+}
+
+err_code_t sched_chan(sched_t *sched, size_t capacity, word_t *out_id) {
+  channel_t *channel = calloc(1, sizeof(channel_t));
+  if (!channel)
+    return ERR_OUT_OF_MEMORY;
+
+  channel->cap = capacity ? capacity : 1;
+  channel->buffer = calloc(channel->cap, sizeof(word_t));
+  if (!channel->buffer) {
+    free(channel);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  pthread_mutex_lock(&sched->lock);
+  if (sched->channel_count >= sched->channel_cap) {
+    sched->channel_cap *= 2;
+    sched->channels = realloc(sched->channels, sizeof(channel_t *) * sched->channel_cap);
+  }
+
+  *out_id = (word_t){.as_u64 = sched->channel_count};
+  sched->channels[sched->channel_count++] = channel;
+  pthread_mutex_unlock(&sched->lock);
+
+  return ERR_OK;
+}
+
+err_code_t sched_send(sched_t *sched, honey_t *vm, word_t id, word_t value,
+                      bool value_is_ref) {
+  if (value_is_ref)
+    return ERR_SHARED_REF;
+
+  pthread_mutex_lock(&sched->lock);
+
+  if (id.as_u64 >= sched->channel_count) {
+    pthread_mutex_unlock(&sched->lock);
+    return ERR_INVALID_HANDLE;
+  }
+
+  channel_t *channel = sched->channels[id.as_u64];
+  if (channel->count < channel->cap) {
+    channel->buffer[(channel->head + channel->count++) % channel->cap] = value;
+    sched_wake_one(sched, &channel->receivers);
+  } else {
+    sched_block(vm, &channel->senders);
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+  return ERR_OK;
+}
+
+err_code_t sched_recv(sched_t *sched, honey_t *vm, word_t id, word_t *out) {
+  pthread_mutex_lock(&sched->lock);
+
+  if (id.as_u64 >= sched->channel_count) {
+    pthread_mutex_unlock(&sched->lock);
+    return ERR_INVALID_HANDLE;
+  }
+
+  channel_t *channel = sched->channels[id.as_u64];
+  if (channel->count > 0) {
+    *out = channel->buffer[channel->head];
+    channel->head = (channel->head + 1) % channel->cap;
+    channel->count--;
+    sched_wake_one(sched, &channel->senders);
+  } else {
+    sched_block(vm, &channel->receivers);
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+  return ERR_OK;
+}
+
+err_code_t sched_io(sched_t *sched, honey_t *vm, aio_request_t *request) {
+  pthread_mutex_lock(&sched->lock);
+
+  if (!sched->aio && !(sched->aio = aio_new())) {
+    pthread_mutex_unlock(&sched->lock);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  fiber_t *fiber = vm->fiber;
+  request->owner = fiber;
+
+  // The ring is full: push the batched submissions out (the worker only
+  // flushes once its queue drains, which a busy queue never does) and
+  // collect what already finished. Still full, wait for a completion to
+  // free an entry and retry the instruction then.
+  bool submitted = aio_submit(sched->aio, request);
+  if (!submitted) {
+    aio_flush(sched->aio);
+    sched_reap_io(sched);
+    submitted = aio_submit(sched->aio, request);
+  }
+
+  if (submitted) {
+    fiber->parked = false;
+    fiber->woken = false;
+    vm->state = HONEY_BLOCKED;
+  } else {
+    request->state = AIO_IDLE;
+    sched_block(vm, &sched->io_full_waiters);
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+  return ERR_OK;
+}
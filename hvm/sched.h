@@ -0,0 +1,97 @@
+#pragma once
+
+#include "aio.h"
+#include "honey.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SCHED_QUANTUM 10000
+#define SCHED_QUEUE_INIT 64
+
+typedef struct fiber {
+  honey_t *vm;
+  size_t id;
+
+  bool done;
+  word_t result;
+
+  // wake protocol, guarded by sched->lock: a fiber that blocked is only
+  // requeued once its worker has parked it, otherwise the wake is recorded
+  // and the worker requeues it itself.
+  bool parked, woken;
+
+  struct fiber *next_waiter;
+  struct fiber *joiners;
+} fiber_t;
+
+typedef struct channel {
+  word_t *buffer;
+  size_t head, count, cap;
+
+  fiber_t *senders;
+  fiber_t *receivers;
+} channel_t;
+
+typedef struct run_queue {
+  pthread_mutex_t lock;
+  fiber_t **items;
+  size_t head, count, cap;
+} run_queue_t;
+
+typedef struct worker {
+  struct sched *sched;
+  size_t index;
+  pthread_t thread;
+  run_queue_t queue;
+} worker_t;
+
+typedef struct sched {
+  const honey_t *root;
+
+  worker_t *workers;
+  size_t worker_count;
+
+  // fibers and channels are addressed by index from bytecode
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  fiber_t **fibers;
+  size_t fiber_count, fiber_cap;
+  channel_t **channels;
+  size_t channel_count, channel_cap;
+
+  // shared by every fiber, guarded by lock; one idle worker at a time
+  // waits for completions outside the lock
+  aio_t *aio;
+  bool io_waiting;
+
+  // fibers that found the ring full, woken as completions free entries
+  fiber_t *io_full_waiters;
+
+  atomic_size_t queued, running;
+  atomic_uint_fast64_t executed_count;
+
+  bool finished;
+  err_code_t status;
+} sched_t;
+
+sched_t *sched_new(size_t worker_count);
+void sched_free(sched_t *sched);
+
+// Runs `root` as the main fiber on all workers until it halts, a fiber
+// panics, or every live fiber is blocked.
+err_code_t sched_run(sched_t *sched, honey_t *root);
+
+bool sched_program_needs(const inst_t *program, size_t program_size);
+
+// `arg_is_ref` / `value_is_ref` are the stack slot's ref bit, a plain
+// integer that happens to alias an object is still sent as a number
+err_code_t sched_spawn(sched_t *sched, honey_t *vm, size_t target, word_t arg,
+                       bool arg_is_ref, word_t *out_id);
+err_code_t sched_join(sched_t *sched, honey_t *vm, word_t id, word_t *out);
+err_code_t sched_chan(sched_t *sched, size_t capacity, word_t *out_id);
+err_code_t sched_send(sched_t *sched, honey_t *vm, word_t id, word_t value,
+                      bool value_is_ref);
+err_code_t sched_recv(sched_t *sched, honey_t *vm, word_t id, word_t *out);
+err_code_t sched_io(sched_t *sched, honey_t *vm, aio_request_t *request);
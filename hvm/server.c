@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef struct {
+  char *data;
+  size_t size, cap;
+} response_t;
+
+typedef struct {
+  server_t *server;
+  int fd;
+} connection_t;
+
+static void response_append(response_t *response, const char *text) {
+  size_t length = strlen(text);
+
+  if (response->size + length + 1 > response->cap) {
+    while (response->size + length + 1 > response->cap)
+      response->cap = response->cap ? response->cap * 2 : 128;
+    response->data = realloc(response->data, response->cap);
+  }
+
+  memcpy(response->data + response->size, text, length + 1);
+  response->size += length;
+}
+
+static void server_collect_dump(honey_t *vm, word_t word, honey_type_t type) {
+  char buffer[32];
+  honey_format_word(buffer, sizeof(buffer), word, type);
+  response_append(vm->userdata, " ");
+  response_append(vm->userdata, buffer);
+}
+
+server_t *server_new(const honey_program_t *program, const honey_native_t *natives,
+                     struct parfor_pool *parfor) {
+  server_t *server = calloc(1, sizeof(server_t));
+  if (!server)
+    return NULL;
+
+  // before the pool, server_free destroys them when a vm cannot be made
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->available, NULL);
+
+  server->program = program;
+  for (size_t i = 0; i < SERVER_POOL_SIZE; i++) {
+    honey_t *vm = honey_new(program->code, program->size);
+    if (!vm) {
+      server_free(server);
+      return NULL;
+    }
+
+    vm->debug = program->debug;
+    vm->natives = natives;
+    vm->native_count = program->import_count;
+    vm->strings = program->strings;
+    vm->string_count = program->string_count;
+    vm->parfor = parfor;
+    vm->on_dump = server_collect_dump;
+    server->pool[server->pool_free++] = vm;
+  }
+
+  return server;
+}
+
+void server_free(server_t *server) {
+  for (size_t i = 0; i < server->pool_free; i++)
+    honey_free(server->pool[i]);
+
+  for (size_t i = 0; i < SERVER_POOL_SIZE; i++)
+    trace_close(server->traces[i]);
+
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->available);
+  free(server);
+}
+
+bool server_trace(server_t *server, const char *prefix) {
+  for (size_t i = 0; i < server->pool_free; i++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%zu", prefix, i);
+
+    server->traces[i] = trace_open(path, server->program->code, server->program->size);
+    if (!server->traces[i])
+      return false;
+    server->pool[i]->trace = server->traces[i];
+  }
+
+  return true;
+}
+
+honey_t *server_acquire(server_t *server) {
+  pthread_mutex_lock(&server->lock);
+  while (server->pool_free == 0)
+    pthread_cond_wait(&server->available, &server->lock);
+
+  honey_t *vm = server->pool[--server->pool_free];
+  pthread_mutex_unlock(&server->lock);
+
+  return vm;
+}
+
+void server_release(server_t *server, honey_t *vm) {
+  honey_reset(vm);
+
+  pthread_mutex_lock(&server->lock);
+  server->pool[server->pool_free++] = vm;
+  pthread_cond_signal(&server->available);
+  pthread_mutex_unlock(&server->lock);
+}
+
+static err_code_t server_seed_stack(honey_t *vm, const char *line) {
+  const char *cursor = line;
+
+  while (1) {
+    while (*cursor == ' ' || *cursor == '\t')
+      cursor++;
+    if (*cursor == '\0' || *cursor == '\n' || *cursor == '\r')
+      return ERR_OK;
+
+    char *end;
+    errno = 0;
+    long long value = strtoll(cursor, &end, 10);
+    if (end == cursor || errno != 0)
+      return ERR_INVALID_REQUEST;
+
+    err_code_t res = honey_stack_push(vm, (word_t){.as_i64 = value});
+    if (res != ERR_OK)
+      return res;
+
+    cursor = end;
+  }
+}
+
+void server_handle_stream(server_t *server, FILE *in, FILE *out) {
+  char *line = NULL;
+  size_t line_cap = 0;
+  response_t response = {0};
+
+  while (getline(&line, &line_cap, in) > 0) {
+    honey_t *vm = server_acquire(server);
+
+    response.size = 0;
+    response_append(&response, "ok");
+    vm->userdata = &response;
+
+    err_code_t res = server_seed_stack(vm, line);
+    if (res == ERR_OK) {
+      if (vm->trace)
+        trace_reset(vm->trace, vm->stack, vm->sp);
+
+      res = honey_interpret(vm);
+
+      if (vm->trace)
+        trace_end(vm->trace, res);
+    }
+
+    server_release(server, vm);
+
+    if (res == ERR_OK)
+      fprintf(out, "%s\n", response.data);
+    else
+      fprintf(out, "err %s\n", honey_error_cstr(res));
+    fflush(out);
+  }
+
+  free(response.data);
+  free(line);
+}
+
+int server_run_stdio(server_t *server) {
+  server_handle_stream(server, stdin, stdout);
+  return EXIT_SUCCESS;
+}
+
+static void *server_connection_thread(void *arg) {
+  connection_t *connection = arg;
+
+  FILE *in = fdopen(connection->fd, "r");
+  FILE *out = fdopen(dup(connection->fd), "w");
+  if (in && out)
+    server_handle_stream(connection->server, in, out);
+
+  if (out)
+    fclose(out);
+  if (in)
+    fclose(in);
+  else
+    close(connection->fd);
+
+  free(connection);
+  return NULL;
+}
+
+int server_run_socket(server_t *server, const char *socket_path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "error -> socket path is too long.\n");
+    return EXIT_FAILURE;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    fprintf(stderr, "error -> cannot create socket: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // a client hanging up mid-response must not take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  unlink(socket_path);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "error -> cannot listen on %s: %s\n", socket_path,
+            strerror(errno));
+    close(listener);
+    return EXIT_FAILURE;
+  }
+
+  while (1) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+
+      fprintf(stderr, "error -> accept failed: %s\n", strerror(errno));
+      break;
+    }
+
+    connection_t *connection = malloc(sizeof(connection_t));
+    *connection = (connection_t){.server = server, .fd = fd};
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_connection_thread, connection) != 0) {
+      close(fd);
+      free(connection);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  close(listener);
+  unlink(socket_path);
+  return EXIT_FAILURE;
+}
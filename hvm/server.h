@@ -0,0 +1,44 @@
+#pragma once
+
+#include "honey.h"
+#include "program.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define SERVER_POOL_SIZE 8
+
+// Request protocol, one request per line:
+//   -> "<i64> <i64> ..."          initial stack, bottom first
+//   <- "ok <value> <value> ...\n" values dumped by the program, in order; i64
+//                                 unless a typed dump says otherwise
+//   <- "err <message>\n"          the program panicked or the line was invalid
+typedef struct server {
+  const honey_program_t *program;
+
+  honey_t *pool[SERVER_POOL_SIZE];
+  size_t pool_free;
+
+  // one trace per pool vm, so recording never crosses threads
+  trace_t *traces[SERVER_POOL_SIZE];
+
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+} server_t;
+
+// `parfor` is lent to every pool vm and stays owned by the caller.
+server_t *server_new(const honey_program_t *program, const honey_native_t *natives,
+                     struct parfor_pool *parfor);
+void server_free(server_t *server);
+
+// Records every request into `<prefix>.<n>`, n being the pool vm serving it.
+bool server_trace(server_t *server, const char *prefix);
+
+honey_t *server_acquire(server_t *server);
+void server_release(server_t *server, honey_t *vm);
+
+void server_handle_stream(server_t *server, FILE *in, FILE *out);
+
+int server_run_stdio(server_t *server);
+int server_run_socket(server_t *server, const char *socket_path);
@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include "program.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MASK (TRACE_RING_WORDS - 1)
+#define TRACE_IDLE_NS 100000
+
+typedef struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t checksum;
+  uint64_t size;
+} trace_header_t;
+
+static bool trace_write_all(int fd, const void *data, size_t size) {
+  const uint8_t *cursor = data;
+  while (size > 0) {
+    ssize_t written = write(fd, cursor, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    cursor += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+static void *trace_flusher(void *arg) {
+  trace_t *trace = arg;
+  uint64_t tail = 0;
+  bool failed = false;
+
+  while (1) {
+    // read stopping first: the final publish happens before it is set
+    bool stopping = atomic_load(&trace->stopping);
+    uint64_t head = atomic_load_explicit(&trace->shared_head, memory_order_acquire);
+
+    if (head == tail) {
+      if (stopping)
+        break;
+
+      struct timespec idle = {.tv_nsec = TRACE_IDLE_NS};
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    while (tail < head) {
+      size_t start = tail & TRACE_MASK;
+      size_t count = head - tail;
+      if (count > TRACE_RING_WORDS - start)
+        count = TRACE_RING_WORDS - start;
+
+      // a failing disk drops events instead of stalling the vm
+      if (!failed && !trace_write_all(trace->fd, &trace->ring[start],
+                                      count * sizeof(uint64_t))) {
+        fprintf(stderr, "warning -> trace write failed: %s\n", strerror(errno));
+        failed = true;
+      }
+
+      tail += count;
+      atomic_store_explicit(&trace->tail, tail, memory_order_release);
+    }
+  }
+
+  return NULL;
+}
+
+trace_t *trace_open(const char *filepath, const inst_t *code, size_t size) {
+  int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "error -> cannot open trace output file '%s'.\n", filepath);
+    return NULL;
+  }
+
+  trace_header_t header = {
+      .version = TRACE_VERSION,
+      .checksum = honey_program_checksum(code, size),
+      .size = size,
+  };
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+  trace_t *trace = calloc(1, sizeof(trace_t));
+  if (trace)
+    trace->ring = malloc(sizeof(uint64_t) * TRACE_RING_WORDS);
+
+  if (!trace || !trace->ring || !trace_write_all(fd, &header, sizeof(header))) {
+    fprintf(stderr, "error -> cannot start trace.\n");
+    if (trace)
+      free(trace->ring);
+    free(trace);
+    close(fd);
+    return NULL;
+  }
+
+  trace->mode = TRACE_RECORD;
+  trace->fd = fd;
+  atomic_init(&trace->shared_head, 0);
+  atomic_init(&trace->tail, 0);
+  atomic_init(&trace->stopping, false);
+  pthread_create(&trace->flusher, NULL, trace_flusher, trace);
+
+  return trace;
+}
+
+void trace_close(trace_t *trace) {
+  if (!trace)
+    return;
+
+  trace_publish(trace);
+  atomic_store(&trace->stopping, true);
+  pthread_join(trace->flusher, NULL);
+
+  close(trace->fd);
+  free(trace->ring);
+  free(trace);
+}
+
+void trace_reserve(trace_t *trace, size_t words) {
+  // whatever is pending has to reach the flusher or this never frees up
+  trace_publish(trace);
+
+  while (1) {
+    trace->cached_tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+    if (trace->head + words - trace->cached_tail <= TRACE_RING_WORDS)
+      return;
+
+    sched_yield();
+  }
+}
+
+static void trace_marker(trace_t *trace, uint64_t op, uint64_t payload) {
+  word_t words[2] = {{.as_u64 = op << 32}, {.as_u64 = payload}};
+  trace_words(trace, words, 2);
+}
+
+void trace_reset(trace_t *trace, const word_t *stack, size_t sp) {
+  trace_marker(trace, TRACE_OP_RESET, sp);
+  for (size_t i = 0; i < sp; i++) {
+    word_t word = stack[i];
+    trace_words(trace, &word, 1);
+  }
+}
+
+void trace_end(trace_t *trace, err_code_t status) {
+  trace_marker(trace, TRACE_OP_END, status);
+
+  // runs can be far apart in server mode, do not sit on a finished one
+  trace_publish(trace);
+}
+
+void trace_bytes(trace_t *trace, void *data, size_t size) {
+  uint8_t *bytes = data;
+
+  if (trace->mode == TRACE_REPLAY) {
+    size_t words = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    if (trace->word_count - trace->cursor < words) {
+      trace->diverged = true;
+      trace->cursor = trace->word_count;
+      return;
+    }
+
+    memcpy(bytes, &trace->words[trace->cursor], size);
+    trace->cursor += words;
+    return;
+  }
+
+  for (size_t offset = 0; offset < size; offset += sizeof(uint64_t)) {
+    word_t word = {0};
+    size_t chunk = size - offset < sizeof(uint64_t) ? size - offset : sizeof(uint64_t);
+    memcpy(&word, bytes + offset, chunk);
+    trace_words(trace, &word, 1);
+  }
+}
+
+trace_t *trace_load(const char *filepath, const inst_t *code, size_t size) {
+  FILE *file = fopen(filepath, "rb");
+  if (!file) {
+    fprintf(stderr, "error -> cannot open trace '%s'.\n", filepath);
+    return NULL;
+  }
+
+  trace_header_t header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION) {
+    fprintf(stderr, "error -> '%s' is not a trace.\n", filepath);
+    fclose(file);
+    return NULL;
+  }
+
+  if (header.size != size || header.checksum != honey_program_checksum(code, size)) {
+    fprintf(stderr, "error -> trace was recorded for a different program.\n");
+    fclose(file);
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  size_t bytes = ftell(file) - sizeof(header);
+  fseek(file, sizeof(header), SEEK_SET);
+
+  trace_t *trace = calloc(1, sizeof(trace_t));
+  uint64_t *words = malloc(bytes ? bytes : 1);
+  trace->word_count = bytes / sizeof(uint64_t);
+  if (fread(words, sizeof(uint64_t), trace->word_count, file) != trace->word_count) {
+    fprintf(stderr, "error -> unexpected error during trace reading.\n");
+    free(words);
+    free(trace);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+
+  trace->mode = TRACE_REPLAY;
+  trace->words = words;
+  trace->stop_at = UINT64_MAX;
+  return trace;
+}
+
+void trace_unload(trace_t *trace) {
+  if (!trace)
+    return;
+
+  free((void *)trace->words);
+  free(trace);
+}
+
+static uint64_t trace_word_op(uint64_t word) { return (word >> 32) & 0xff; }
+
+bool trace_replay_step(trace_t *trace, size_t ip, inst_op_t op) {
+  if (trace->diverged || trace->count >= trace->stop_at ||
+      trace->cursor >= trace->word_count)
+    return false;
+
+  uint64_t word = trace->words[trace->cursor];
+  uint64_t recorded = trace_word_op(word);
+  if (recorded == TRACE_OP_RESET || recorded == TRACE_OP_END)
+    return false;
+
+  if ((word & 0xffffffffull) != ip || recorded != (uint64_t)op) {
+    trace->diverged = true;
+    return false;
+  }
+
+  trace->cursor++;
+  trace->count++;
+  return true;
+}
+
+void trace_replay_words(trace_t *trace, word_t *words, size_t count) {
+  if (trace->word_count - trace->cursor < count) {
+    trace->diverged = true;
+    trace->cursor = trace->word_count;
+    return;
+  }
+
+  memcpy(words, &trace->words[trace->cursor], sizeof(word_t) * count);
+  trace->cursor += count;
+}
+
+err_code_t trace_replay(trace_t *trace, honey_t *vm, uint64_t *out_run) {
+  err_code_t status = ERR_OK;
+  *out_run = 0;
+
+  while (trace->cursor + 1 < trace->word_count && !trace->diverged &&
+         trace->count < trace->stop_at) {
+    uint64_t marker = trace_word_op(trace->words[trace->cursor]);
+    uint64_t payload = trace->words[trace->cursor + 1];
+
+    if (marker == TRACE_OP_END) {
+      trace->cursor += 2;
+      continue;
+    }
+
+    if (marker != TRACE_OP_RESET || payload > STACK_MAX ||
+        trace->word_count - trace->cursor - 2 < payload) {
+      trace->diverged = true;
+      break;
+    }
+
+    honey_reset(vm);
+    trace->cursor += 2;
+    for (uint64_t i = 0; i < payload; i++)
+      honey_stack_push(vm, (word_t){.as_u64 = trace->words[trace->cursor++]});
+    (*out_run)++;
+
+    status = honey_interpret(vm);
+    if (status == ERR_OK && vm->state != HONEY_HALTED) {
+      // stopped in front of an instruction: either where we were asked to,
+      // or the trace ended (the process died) or no longer matches
+      if (trace->count < trace->stop_at && trace->cursor < trace->word_count &&
+          !trace->diverged)
+        trace->diverged = true;
+      break;
+    }
+  }
+
+  return status;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "honey.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "HNYTRACE"
+#define TRACE_VERSION 1
+
+// ring size in words, must be a power of two
+#define TRACE_RING_WORDS (1u << 20)
+// words written before they are handed to the flusher
+#define TRACE_BATCH 256
+
+// Every executed instruction is one word: ip | op << 32 | flags << 40.
+// Instructions whose effect depends on the outside world append payload
+// words: dump the value, callnative its results, I/O ops their result and
+// read its data. Runs are delimited by markers that reuse the op field.
+#define TRACE_OP_RESET 0xff // payload: sp, then the initial stack
+#define TRACE_OP_END 0xfe   // payload: status
+#define TRACE_TAKEN (1ull << 40)
+
+typedef enum trace_mode {
+  TRACE_RECORD,
+  TRACE_REPLAY,
+} trace_mode_t;
+
+// Recording is a single-producer ring owned by one vm: the interpreter
+// writes words and publishes them in batches, a flusher thread writes the
+// published words to disk. Replay walks a trace loaded into memory and
+// feeds the recorded payloads back into the interpreter.
+typedef struct trace {
+  trace_mode_t mode;
+  uint64_t count;
+
+  // record
+  uint64_t *ring;
+  uint64_t head, current, published, cached_tail;
+  _Atomic uint64_t shared_head, tail;
+  atomic_bool stopping;
+  pthread_t flusher;
+  int fd;
+
+  // replay
+  const uint64_t *words;
+  size_t word_count, cursor;
+  uint64_t stop_at;
+  bool diverged;
+} trace_t;
+
+trace_t *trace_open(const char *filepath, const inst_t *code, size_t size);
+void trace_close(trace_t *trace);
+
+trace_t *trace_load(const char *filepath, const inst_t *code, size_t size);
+void trace_unload(trace_t *trace);
+
+// Re-executes every recorded run on `vm` until the trace ends, diverges
+// from the program, or `stop_at` instructions have run; the vm is left in
+// the state the recorded one had at that point.
+err_code_t trace_replay(trace_t *trace, honey_t *vm, uint64_t *out_run);
+
+void trace_reset(trace_t *trace, const word_t *stack, size_t sp);
+void trace_end(trace_t *trace, err_code_t status);
+
+// slow paths of the inline helpers below
+void trace_reserve(trace_t *trace, size_t words);
+bool trace_replay_step(trace_t *trace, size_t ip, inst_op_t op);
+void trace_replay_words(trace_t *trace, word_t *words, size_t count);
+void trace_bytes(trace_t *trace, void *data, size_t size);
+
+static inline void trace_publish(trace_t *trace) {
+  atomic_store_explicit(&trace->shared_head, trace->head, memory_order_release);
+  trace->published = trace->head;
+}
+
+// Called before each instruction executes. Returns false when a replay
+// has to stop in front of it.
+static inline bool trace_step(trace_t *trace, size_t ip, inst_op_t op) {
+  if (trace->mode == TRACE_REPLAY)
+    return trace_replay_step(trace, ip, op);
+
+  // the previous instruction is complete, so its words can go out
+  if (trace->head - trace->published >= TRACE_BATCH)
+    trace_publish(trace);
+  if (trace->head - trace->cached_tail >= TRACE_RING_WORDS)
+    trace_reserve(trace, 1);
+
+  trace->current = trace->head;
+  trace->ring[trace->head++ & (TRACE_RING_WORDS - 1)] =
+      (uint64_t)ip | (uint64_t)op << 32;
+  trace->count++;
+  return true;
+}
+
+static inline void trace_branch(trace_t *trace, bool taken) {
+  if (trace->mode == TRACE_REPLAY) {
+    uint64_t recorded = trace->words[trace->cursor - 1] & TRACE_TAKEN;
+    if (recorded != (taken ? TRACE_TAKEN : 0))
+      trace->diverged = true;
+    return;
+  }
+
+  if (taken)
+    trace->ring[trace->current & (TRACE_RING_WORDS - 1)] |= TRACE_TAKEN;
+}
+
+static inline bool trace_replaying(const trace_t *trace) {
+  return trace && trace->mode == TRACE_REPLAY;
+}
+
+// Records `words`, or overwrites them with the recorded ones on replay.
+static inline void trace_words(trace_t *trace, word_t *words, size_t count) {
+  if (trace->mode == TRACE_REPLAY) {
+    trace_replay_words(trace, words, count);
+    return;
+  }
+
+  if (trace->head + count - trace->cached_tail > TRACE_RING_WORDS)
+    trace_reserve(trace, count);
+
+  for (size_t i = 0; i < count; i++)
+    trace->ring[trace->head++ & (TRACE_RING_WORDS - 1)] = words[i].as_u64;
+}
@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+# Assembles and runs every tests/*.hasm, comparing stdout plus the exit code
+# with tests/<name>.out. When tests/<name>.in exists the program runs in
+# --serve mode with it as the request stream. run_<name>.hasm goes through
+# `hvm run` instead, with stderr kept, so assembly errors are compared too.
+# Extra hvm options go in tests/<name>.args. When tests/<name>.hot exists the
+# program is also run under --profile, and the instruction with the most
+# samples must be the one it names. When tests/<name>.ops exists the program
+# is also run under --perf-stat, and the reported bytecode count must match.
+set -uo pipefail
+
+BUILD_DIR="$(realpath "${BUILD_DIR:-build}")"
+TESTS_DIR="$(dirname "$0")"
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+failed=0
+total=0
+for source in "$TESTS_DIR"/*.hasm; do
+    name="$(basename "$source" .hasm)"
+    bytecode="$WORK_DIR/$name.hbc"
+    actual="$WORK_DIR/$name.out"
+    total=$((total + 1))
+
+    args=()
+    if [ -f "$TESTS_DIR/$name.args" ]; then
+        read -ra args <"$TESTS_DIR/$name.args"
+    fi
+
+    if [[ "$name" == run_* ]]; then
+        (cd "$TESTS_DIR" && "$BUILD_DIR/hvm" run --no-cache "$name.hasm") </dev/null >"$actual" 2>&1
+    elif ! "$BUILD_DIR/hasm" "$source" "$bytecode" 2>"$WORK_DIR/$name.err"; then
+        echo "FAIL $name (assembly)"
+        cat "$WORK_DIR/$name.err"
+        failed=$((failed + 1))
+        continue
+    elif [ -f "$TESTS_DIR/$name.in" ]; then
+        "$BUILD_DIR/hvm" "${args[@]}" --serve "$bytecode" <"$TESTS_DIR/$name.in" >"$actual" 2>/dev/null
+    else
+        "$BUILD_DIR/hvm" "${args[@]}" "$bytecode" </dev/null >"$actual" 2>/dev/null
+    fi
+    echo "exit $?" >>"$actual"
+
+    if ! diff -u "$TESTS_DIR/$name.out" "$actual"; then
+        echo "FAIL $name"
+        failed=$((failed + 1))
+        continue
+    fi
+
+    if [ -f "$TESTS_DIR/$name.hot" ]; then
+        # folded lines without a debug section read "IP=<ip> <op> <samples>"
+        "$BUILD_DIR/hvm" "${args[@]}" --profile "$WORK_DIR/$name.folded" "$bytecode" \
+            </dev/null >/dev/null 2>&1
+        hot="$(sort -k3 -n -r "$WORK_DIR/$name.folded" 2>/dev/null | head -n 1 | cut -d' ' -f2)"
+        if [ "$hot" != "$(cat "$TESTS_DIR/$name.hot")" ]; then
+            echo "FAIL $name (profile charged ${hot:-nothing}, expected $(cat "$TESTS_DIR/$name.hot"))"
+            failed=$((failed + 1))
+        fi
+    fi
+
+    if [ -f "$TESTS_DIR/$name.ops" ]; then
+        # hardware counters vary from run to run, the vm's own count does not
+        ops="$("$BUILD_DIR/hvm" "${args[@]}" --perf-stat "$bytecode" 2>&1 >/dev/null </dev/null |
+            awk '$2 == "bytecode" { print $1 }')"
+        if [ "$ops" != "$(cat "$TESTS_DIR/$name.ops")" ]; then
+            echo "FAIL $name (perf-stat counted ${ops:-nothing}, expected $(cat "$TESTS_DIR/$name.ops"))"
+            failed=$((failed + 1))
+        fi
+    fi
+done
+
+echo "log -> $((total - failed))/$total tests passed"
+[ "$failed" -eq 0 ]